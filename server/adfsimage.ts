@@ -74,7 +74,7 @@ function getNumSectors(image: Buffer): number {
     return utils.readUInt24LE(image, 0xfc);
 }
 
-function getSectorOffset(image: Buffer, logicalSector: number): number {
+export function getSectorOffset(image: Buffer, logicalSector: number): number {
     if (image.length === L_SIZE_BYTES) {
         let track = Math.floor(logicalSector / TRACK_SIZE_SECTORS);
         const side = Math.floor(track / 80);
@@ -22,7 +22,9 @@
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+import * as fs from 'fs';
 import * as os from 'os';
+import * as crypto from 'crypto';
 import * as path from 'path';
 import { DEFAULT_FIRST_FILE_HANDLE, DEFAULT_NUM_FILE_HANDLES } from './beeblink';
 import * as utils from './utils';
@@ -57,9 +59,19 @@ export const DEFAULT_ATTR = R_ATTR | W_ATTR;
 const IGNORE_DIR_FILE_NAME = utils.getCaseNormalizedPath('.beeblink-ignore');
 
 const VOLUME_FILE_NAME = '.volume';
+const VOLUME_FILE_NAME_NORMALIZED = utils.getCaseNormalizedPath(VOLUME_FILE_NAME);
 
 const HOST_NAME_ESCAPE_CHAR = '#';
 
+// Max number of converted text files to keep around for OSFIND.
+const MAX_NUM_CACHED_TEXT_FILES = 16;
+
+// Max number of folders to read at once when searching for volumes.
+const MAX_NUM_CONCURRENT_VOLUME_FOLDER_READS = 16;
+
+// Max number of file fingerprints to keep around.
+const MAX_NUM_FINGERPRINTS = 4096;
+
 const HOST_NAME_CHARS: string[] = [];
 for (let c = 0; c < 256; ++c) {
     let escape = false;
@@ -194,6 +206,226 @@ export class File {
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+const SPARSE_DATA_PAGE_SIZE = 4096;
+
+const gZeroPage = Buffer.alloc(SPARSE_DATA_PAGE_SIZE);
+
+// File contents, held as fixed-size pages. Pages that have never been
+// written - e.g., after EXT# has been used to pre-extend a random-access file
+// - aren't stored, and read as zeros.
+//
+// Pages modified since the last clearDirtyPages are tracked, so a checkpoint
+// needn't include the parts that are the same as on disk.
+class SparseData {
+    private length: number;
+    private readonly pages = new Map<number, Buffer>();
+    private readonly dirtyPageIdxs = new Set<number>();
+
+    // If length is larger than data, the remainder is a hole.
+    public constructor(data: Buffer | undefined, length?: number) {
+        this.length = 0;
+
+        if (data !== undefined) {
+            for (let offset = 0; offset < data.length; offset += SPARSE_DATA_PAGE_SIZE) {
+                const end = Math.min(offset + SPARSE_DATA_PAGE_SIZE, data.length);
+
+                if (!SparseData.isZero(data, offset, end)) {
+                    const page = Buffer.alloc(SPARSE_DATA_PAGE_SIZE);
+                    data.copy(page, 0, offset, end);
+                    this.pages.set(offset / SPARSE_DATA_PAGE_SIZE, page);
+                }
+            }
+
+            this.length = data.length;
+        }
+
+        if (length !== undefined && length > this.length) {
+            this.length = length;
+        }
+    }
+
+    public getLength(): number {
+        return this.length;
+    }
+
+    public setLength(length: number): void {
+        if (length < this.length) {
+            const numPages = Math.ceil(length / SPARSE_DATA_PAGE_SIZE);
+            for (const pageIdx of Array.from(this.pages.keys())) {
+                if (pageIdx >= numPages) {
+                    this.pages.delete(pageIdx);
+                    this.dirtyPageIdxs.add(pageIdx);
+                }
+            }
+
+            // Zap the truncated part of the last page, so it reads as zeros
+            // if the file is extended again.
+            const lastPage = this.pages.get(numPages - 1);
+            if (lastPage !== undefined) {
+                lastPage.fill(0, length - (numPages - 1) * SPARSE_DATA_PAGE_SIZE);
+                this.dirtyPageIdxs.add(numPages - 1);
+            }
+        }
+
+        this.length = length;
+    }
+
+    public getByte(offset: number): number {
+        const page = this.pages.get(Math.floor(offset / SPARSE_DATA_PAGE_SIZE));
+        if (page === undefined) {
+            return 0;
+        }
+
+        return page[offset % SPARSE_DATA_PAGE_SIZE];
+    }
+
+    // Writing past the end extends the data.
+    public setByte(offset: number, value: number): void {
+        const pageIdx = Math.floor(offset / SPARSE_DATA_PAGE_SIZE);
+
+        let page = this.pages.get(pageIdx);
+        if (page === undefined) {
+            page = Buffer.alloc(SPARSE_DATA_PAGE_SIZE);
+            this.pages.set(pageIdx, page);
+        }
+
+        page[offset % SPARSE_DATA_PAGE_SIZE] = value;
+        this.dirtyPageIdxs.add(pageIdx);
+
+        if (offset >= this.length) {
+            this.length = offset + 1;
+        }
+    }
+
+    // Range must be within the data.
+    public read(offset: number, numBytes: number): Buffer {
+        const data = Buffer.alloc(numBytes);
+
+        let i = 0;
+        while (i < numBytes) {
+            const pageIdx = Math.floor((offset + i) / SPARSE_DATA_PAGE_SIZE);
+            const pageOffset = (offset + i) % SPARSE_DATA_PAGE_SIZE;
+            const n = Math.min(SPARSE_DATA_PAGE_SIZE - pageOffset, numBytes - i);
+
+            const page = this.pages.get(pageIdx);
+            if (page !== undefined) {
+                page.copy(data, i, pageOffset, pageOffset + n);
+            }
+
+            i += n;
+        }
+
+        return data;
+    }
+
+    // Like read, but returns a list of slices of the pages (or of the zero
+    // page, for holes) rather than a copy. The slices share storage with the
+    // data, so they mustn't be modified, and must be used up before the data
+    // is next modified.
+    public readSlices(offset: number, numBytes: number): Buffer[] {
+        const slices: Buffer[] = [];
+
+        let i = 0;
+        while (i < numBytes) {
+            const pageIdx = Math.floor((offset + i) / SPARSE_DATA_PAGE_SIZE);
+            const pageOffset = (offset + i) % SPARSE_DATA_PAGE_SIZE;
+            const n = Math.min(SPARSE_DATA_PAGE_SIZE - pageOffset, numBytes - i);
+
+            let page = this.pages.get(pageIdx);
+            if (page === undefined) {
+                page = gZeroPage;
+            }
+
+            slices.push(page.slice(pageOffset, pageOffset + n));
+
+            i += n;
+        }
+
+        return slices;
+    }
+
+    // Length of the data, ignoring any hole at the end.
+    public getUsedLength(): number {
+        let numPages = 0;
+        for (const pageIdx of this.pages.keys()) {
+            numPages = Math.max(numPages, pageIdx + 1);
+        }
+
+        return Math.min(numPages * SPARSE_DATA_PAGE_SIZE, this.length);
+    }
+
+    // Non-hole parts, in order.
+    public getExtents(): utils.ISparseFileExtent[] {
+        const pages = Array.from(this.pages.entries()).sort((a, b) => a[0] - b[0]);
+
+        const extents: utils.ISparseFileExtent[] = [];
+        for (const [pageIdx, page] of pages) {
+            const offset = pageIdx * SPARSE_DATA_PAGE_SIZE;
+            extents.push({ offset, data: page.slice(0, Math.min(SPARSE_DATA_PAGE_SIZE, this.length - offset)) });
+        }
+
+        return extents;
+    }
+
+    // Pages modified since the last clearDirtyPages, by page index. A page
+    // that's been removed by truncation is undefined.
+    public getDirtyPages(): Map<number, Buffer | undefined> {
+        const dirtyPages = new Map<number, Buffer | undefined>();
+        for (const pageIdx of this.dirtyPageIdxs) {
+            dirtyPages.set(pageIdx, this.pages.get(pageIdx));
+        }
+
+        return dirtyPages;
+    }
+
+    public clearDirtyPages(): void {
+        this.dirtyPageIdxs.clear();
+    }
+
+    // Replace a whole page, e.g., with one from getDirtyPages. The page is
+    // dirty afterwards. The length is unaffected.
+    public setPage(pageIdx: number, page: Buffer | undefined): void {
+        if (page === undefined) {
+            this.pages.delete(pageIdx);
+        } else {
+            const copy = Buffer.alloc(SPARSE_DATA_PAGE_SIZE);
+            page.copy(copy, 0, 0, Math.min(page.length, SPARSE_DATA_PAGE_SIZE));
+            this.pages.set(pageIdx, copy);
+        }
+
+        this.dirtyPageIdxs.add(pageIdx);
+    }
+
+    // Same result as getFingerprint(this.read(0, this.getLength())).
+    public getFingerprint(): string {
+        const hash = crypto.createHash('sha1');
+
+        for (let offset = 0; offset < this.length; offset += SPARSE_DATA_PAGE_SIZE) {
+            let page = this.pages.get(offset / SPARSE_DATA_PAGE_SIZE);
+            if (page === undefined) {
+                page = gZeroPage;
+            }
+
+            hash.update(page.slice(0, Math.min(SPARSE_DATA_PAGE_SIZE, this.length - offset)));
+        }
+
+        return hash.digest('hex');
+    }
+
+    private static isZero(data: Buffer, begin: number, end: number): boolean {
+        for (let i = begin; i < end; ++i) {
+            if (data[i] !== 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 class OpenFile {
     public readonly hostPath: string;
     public readonly fqn: FQN;
@@ -203,11 +435,23 @@ class OpenFile {
     public eofError: boolean;// http://beebwiki.mdfs.net/OSBGET
     public dirty: boolean;
 
+    // Bumped by every modification, so a flush can tell whether the contents
+    // changed while it was writing them out.
+    public numModifications: number;
+
     // I wasn't going to buffer anything originally, but I quickly found it
     // massively simplifies the error handling.
-    public readonly contents: number[];
+    public readonly contents: SparseData;
+
+    // Whether contents were converted with getTextFileWithCRLineEndings.
+    public readonly text: boolean;
+
+    // Size and mtime of the file on disk as of when the contents were last
+    // read or written, so a checkpoint can tell if it's changed since.
+    public diskSize: number;
+    public diskMtimeMs: number;
 
-    public constructor(hostPath: string, fqn: FQN, read: boolean, write: boolean, contents: number[]) {
+    public constructor(hostPath: string, fqn: FQN, read: boolean, write: boolean, contents: SparseData, text: boolean) {
         this.hostPath = hostPath;
         this.fqn = fqn;
         this.read = read;
@@ -215,13 +459,164 @@ class OpenFile {
         this.ptr = 0;
         this.eofError = false;
         this.contents = contents;
+        this.text = text;
         this.dirty = false;
+        this.numModifications = 0;
+        this.diskSize = -1;
+        this.diskMtimeMs = -1;
+    }
+
+    public setDiskStat(stat: fs.Stats | undefined): void {
+        if (stat !== undefined) {
+            this.diskSize = stat.size;
+            this.diskMtimeMs = stat.mtimeMs;
+        } else {
+            this.diskSize = -1;
+            this.diskMtimeMs = -1;
+        }
+    }
+
+    public markDirty(): void {
+        this.dirty = true;
+        ++this.numModifications;
     }
 }
 
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Contents of a text file, as converted for OSFIND, shared between all
+// connections. Entries are only valid while the file's size and mtime are
+// unchanged.
+class CachedTextFile {
+    public readonly size: number;
+    public readonly mtimeMs: number;
+    public readonly contents: Buffer;
+
+    public constructor(size: number, mtimeMs: number, contents: Buffer) {
+        this.size = size;
+        this.mtimeMs = mtimeMs;
+        this.contents = contents;
+    }
+}
+
+// Oldest first.
+const gCachedTextFileByHostPath = new Map<string, CachedTextFile>();
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Bumped after every change the server makes to the files on disk, from any
+// connection, in this process or (via IFSSharing) any other server process.
+// Anything remembered about the FS can compare generations to see if it
+// might be out of date. (Changes made on the host side don't count.)
+let gWriteGeneration = 0;
+
+// Every IFSSharing in use, to be told about writes.
+const gSharings = new Set<IFSSharing>();
+
+export function getWriteGeneration(): number {
+    return gWriteGeneration;
+}
+
+// hostPath is undefined if the change isn't to a file, and only affects this
+// process.
+function bumpWriteGeneration(hostPath: string | undefined): void {
+    ++gWriteGeneration;
+
+    if (hostPath !== undefined) {
+        for (const sharing of gSharings) {
+            sharing.fileWritten(hostPath);
+        }
+    }
+}
+
+// Call when another server process has written to a file. Anything cached
+// about it is discarded.
+export function fileWrittenElsewhere(hostPath: string): void {
+    ++gWriteGeneration;
+
+    gFingerprintByHostPath.delete(hostPath);
+    gCachedTextFileByHostPath.delete(hostPath);
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Hash of a file's contents, shared between all connections. Computed when
+// the file is written, or lazily when it's first needed. Same validity rules
+// as CachedTextFile.
+class FileFingerprint {
+    public readonly size: number;
+    public readonly mtimeMs: number;
+    public readonly hash: string;
+
+    public constructor(size: number, mtimeMs: number, hash: string) {
+        this.size = size;
+        this.mtimeMs = mtimeMs;
+        this.hash = hash;
+    }
+}
+
+// Oldest first.
+const gFingerprintByHostPath = new Map<string, FileFingerprint>();
+
+function getFingerprint(data: Buffer): string {
+    return crypto.createHash('sha1').update(data).digest('hex');
+}
+
+async function updateFingerprint(hostPath: string, hash: string): Promise<void> {
+    gFingerprintByHostPath.delete(hostPath);
+
+    const stat = await utils.tryStat(hostPath);
+    if (stat === undefined) {
+        return;
+    }
+
+    while (gFingerprintByHostPath.size >= MAX_NUM_FINGERPRINTS) {
+        const oldestHostPath = gFingerprintByHostPath.keys().next().value;
+        gFingerprintByHostPath.delete(oldestHostPath);
+    }
+
+    gFingerprintByHostPath.set(hostPath, new FileFingerprint(stat.size, stat.mtimeMs, hash));
+}
+
+// Forget any fingerprint for the file at the given path, when it's been
+// modified other than by writeFile/writeSparseFile.
+function forgetFingerprint(hostPath: string): void {
+    gFingerprintByHostPath.delete(hostPath);
+}
+
+// Get fingerprint of the file at the given path, or undefined if it can't be
+// read. If the size is known not to match, don't bother.
+export async function tryGetFingerprint(hostPath: string, expectedSize?: number): Promise<string | undefined> {
+    const stat = await utils.tryStat(hostPath);
+    if (stat === undefined || !stat.isFile()) {
+        return undefined;
+    }
+
+    if (expectedSize !== undefined && stat.size !== expectedSize) {
+        return undefined;
+    }
+
+    const fingerprint = gFingerprintByHostPath.get(hostPath);
+    if (fingerprint !== undefined && fingerprint.size === stat.size && fingerprint.mtimeMs === stat.mtimeMs) {
+        return fingerprint.hash;
+    }
+
+    const data = await utils.tryReadFile(hostPath);
+    if (data === undefined) {
+        return undefined;
+    }
+
+    const hash = getFingerprint(data);
+    await updateFingerprint(hostPath, hash);
+    return hash;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 export class Volume {
     public readonly path: string;
     public readonly name: string;
@@ -297,13 +692,28 @@ export class OSGBPBResult {
     public readonly c: boolean;
     public readonly numBytesLeft: number | undefined;
     public readonly ptr: number | undefined;
-    public readonly data: Buffer | undefined;
 
-    public constructor(c: boolean, numBytesLeft: number | undefined, ptr: number | undefined, data: Buffer | undefined) {
+    // Output data, in parts - concatenate them to get the actual data. These
+    // may share storage with the file contents, so don't modify them.
+    public readonly data: Buffer[] | undefined;
+
+    public constructor(c: boolean, numBytesLeft: number | undefined, ptr: number | undefined, data: Buffer | Buffer[] | undefined) {
         this.c = c;
         this.numBytesLeft = numBytesLeft;
         this.ptr = ptr;
-        this.data = data;
+        this.data = data instanceof Buffer ? [data] : data;
+    }
+
+    public getDataLength(): number {
+        let length = 0;
+
+        if (this.data !== undefined) {
+            for (const part of this.data) {
+                length += part.length;
+            }
+        }
+
+        return length;
     }
 }
 
@@ -329,12 +739,46 @@ export class OSFILEResult {
 
 // Write a file to disk, creating the folder for it if required and throwing a
 // suitable BBC-friendly error if something goes wrong.
-export async function writeFile(filePath: string, data: Buffer): Promise<void> {
+//
+// If the file already has the given contents, it's left untouched. Returns
+// true if the file was written.
+export async function writeFile(filePath: string, data: Buffer): Promise<boolean> {
+    const hash = getFingerprint(data);
+    if (await tryGetFingerprint(filePath, data.length) === hash) {
+        return false;
+    }
+
     try {
         await utils.fsMkdirAndWriteFile(filePath, data);
     } catch (error) {
         return errors.nodeError(error);
+    } finally {
+        bumpWriteGeneration(filePath);
+    }
+
+    await updateFingerprint(filePath, hash);
+
+    return true;
+}
+
+// As writeFile, for data that may have holes in it. The holes aren't written.
+async function writeSparseFile(filePath: string, data: SparseData): Promise<boolean> {
+    const hash = data.getFingerprint();
+    if (await tryGetFingerprint(filePath, data.getLength()) === hash) {
+        return false;
+    }
+
+    try {
+        await utils.fsMkdirAndWriteSparseFile(filePath, data.getLength(), data.getExtents());
+    } catch (error) {
+        return errors.nodeError(error);
+    } finally {
+        bumpWriteGeneration(filePath);
     }
+
+    await updateFingerprint(filePath, hash);
+
+    return true;
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -424,6 +868,10 @@ export interface IFSType {
     // create new state for this type of FS.
     createState(volume: Volume, state: any | undefined, log: utils.Log): IFSState;
 
+    // recreate settings object, as returned by IFSState.getSettings, from the
+    // result of round-tripping it through JSON. Return undefined if invalid.
+    createSettings(json: any): any | undefined;
+
     // whether this FS supports writing.
     canWrite(): boolean;
 
@@ -529,13 +977,220 @@ export async function getBeebFile(fqn: FQN, wildcardsOK: boolean, throwIfNotFoun
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Live list of all known volumes, shared between all connections, kept sorted
+// by name.
+//
+// The arrays are replaced rather than modified whenever the list changes, so
+// callers can hang on to the results of getVolumes/getNameLCs for as long as
+// they like.
+//
+// While the initial scan is running, the list is incomplete, and volumes are
+// added as they're found.
+export class VolumeRegistry {
+    private volumes: Volume[];
+    private nameLCs: string[];
+
+    // Volumes added since the list was last sorted.
+    private newVolumes: Volume[];
+
+    private paths: Set<string>;
+    private complete: boolean;
+
+    public constructor(volumes: Volume[], complete: boolean) {
+        this.volumes = [];
+        this.nameLCs = [];
+        this.newVolumes = [];
+        this.paths = new Set<string>();
+        this.complete = complete;
+        this.set(volumes);
+    }
+
+    // Sorted by name, case-insensitively.
+    public getVolumes(): ReadonlyArray<Volume> {
+        this.sort();
+        return this.volumes;
+    }
+
+    // Lower case name of each volume, in the same order as getVolumes.
+    public getNameLCs(): ReadonlyArray<string> {
+        this.sort();
+        return this.nameLCs;
+    }
+
+    public isComplete(): boolean {
+        return this.complete;
+    }
+
+    public setComplete(): void {
+        this.complete = true;
+    }
+
+    public set(volumes: Volume[]): void {
+        this.volumes = [];
+        this.nameLCs = [];
+        this.newVolumes = [];
+        this.paths.clear();
+
+        for (const volume of volumes) {
+            this.add(volume);
+        }
+    }
+
+    public add(volume: Volume): void {
+        if (this.paths.has(volume.path)) {
+            return;
+        }
+
+        this.paths.add(volume.path);
+        this.newVolumes.push(volume);
+    }
+
+    private sort(): void {
+        if (this.newVolumes.length === 0) {
+            return;
+        }
+
+        const sorted = this.volumes.concat(this.newVolumes);
+        sorted.sort((a, b) => utils.stricmp(a.name, b.name));
+
+        this.volumes = sorted;
+        this.nameLCs = sorted.map((volume) => volume.name.toLowerCase());
+        this.newVolumes = [];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Plain JSON snapshot of an FS's session state, as saved by
+// FS.getCheckpoint. Open files are saved with their contents, so that a
+// restarted server can carry on where the old one left off.
+export interface IFSCheckpoint {
+    volume: IVolumeCheckpoint | null;
+    settings: any;
+    defaults: any;
+    firstFileHandle: number;
+    openFiles: (IOpenFileCheckpoint | null)[];
+}
+
+export interface IVolumeCheckpoint {
+    path: string;
+    name: string;
+    type: string;
+    readOnly: boolean;
+}
+
+export interface IOpenFileCheckpoint {
+    hostPath: string;
+    fqn: string;
+    read: boolean;
+    write: boolean;
+    ptr: number;
+    eofError: boolean;
+    text: boolean;
+
+    // Identity of the file on disk that the contents are based on. The
+    // handle isn't restored if it's changed since.
+    diskSize: number;
+    diskMtimeMs: number;
+
+    size: number;
+    dirty: boolean;
+
+    // Pages that differ from what's on disk, by page index - base64, or null
+    // if removed by truncation.
+    dirtyPages: { [pageIdx: string]: string | null };
+}
+
+// Result of looking in one folder for volumes. Subfolders are searched
+// concurrently, but the results are consumed in order.
+interface IVolumeFolderScan {
+    volumes: Volume[];
+    subfolderScans: Promise<IVolumeFolderScan>[];
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Coordinates FSs in different server processes (see workers.ts). Each FS
+// already checks its own open files; this covers everybody else's.
+export interface IFSSharing {
+    // lock file for read (shared) or write (exclusive). Returns false if
+    // somebody else has it locked.
+    lockFile(hostPath: string, write: boolean): Promise<boolean>;
+
+    unlockFile(hostPath: string, write: boolean): void;
+
+    // file has been written, deleted, etc. - see fileWrittenElsewhere.
+    fileWritten(hostPath: string): void;
+
+    volumeCreated(volume: Volume): void;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+const gFSTypeByName = new Map<string, IFSType>([
+    ['dfs', dfsType],
+    ['pc', pcType],
+]);
+
+function getFSTypeName(type: IFSType): string {
+    for (const [name, t] of gFSTypeByName) {
+        if (t === type) {
+            return name;
+        }
+    }
+
+    return errors.generic('Unknown volume type');
+}
+
+// Plain JSON description of a volume, for checkpoints and for passing between
+// server processes.
+export function getVolumeJSON(volume: Volume): IVolumeCheckpoint {
+    return {
+        path: volume.path,
+        name: volume.name,
+        type: getFSTypeName(volume.type),
+        readOnly: volume.isReadOnly() && volume.type.canWrite(),
+    };
+}
+
+// Returns undefined if the type is unknown. Doesn't check the volume exists.
+export function tryCreateVolumeFromJSON(json: IVolumeCheckpoint): Volume | undefined {
+    const type = gFSTypeByName.get(json.type);
+    if (type === undefined) {
+        return undefined;
+    }
+
+    const volume = new Volume(json.path, json.name, type);
+    return json.readOnly ? volume.asReadOnly() : volume;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 export class FS {
 
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
-    public static async findAllVolumes(folders: string[], pcFolders: string[], log: utils.Log | undefined): Promise<Volume[]> {
-        return await FS.findVolumes('*', false, folders, pcFolders, log);
+    // If supplied, found is called for each volume as it's found.
+    public static async findAllVolumes(folders: string[], pcFolders: string[], log: utils.Log | undefined, found?: (volume: Volume) => void): Promise<Volume[]> {
+        return await FS.findVolumes('*', false, folders, pcFolders, log, found);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Find volume with the given name, stopping as soon as it's found.
+    public static async findVolumeByName(name: string, folders: string[], pcFolders: string[], log: utils.Log | undefined): Promise<Volume | undefined> {
+        // Volume names match case-insensitively, so filter on the exact name
+        // during the search, or a volume that differs only in case could be
+        // found first and stop it.
+        const volumes = await FS.findVolumes(name, true, folders, pcFolders, log, undefined, (volumeName) => volumeName === name);
+
+        return volumes.length > 0 ? volumes[0] : undefined;
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -566,6 +1221,29 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
+    // Get fingerprint of the given file's contents. Files with the same
+    // fingerprint have the same contents.
+    public static async getFingerprint(file: File): Promise<string> {
+        const hash = await tryGetFingerprint(file.hostPath);
+        if (hash === undefined) {
+            return errors.fileNotFound();
+        }
+
+        return hash;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Whether writing the given metadata (as from the given FQN) to the given
+    // existing file would leave its metadata unchanged.
+    private static isSameMetadata(file: File, fqn: FQN, load: number, exec: number, attr: number): boolean {
+        return file.load === load && file.exec === exec && file.attr === attr && file.fqn.fsFQN.toString() === fqn.fsFQN.toString();
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
     // Causes a 'Too big' error if the value is larger than the max file size.
     private static mustNotBeTooBig(amount: number): void {
         if (amount > MAX_FILE_SIZE) {
@@ -604,12 +1282,26 @@ export class FS {
     // result clear: that is, is if the voume spec is unambiguous, when the
     // first matching volume is found, or, if the volume spec is ambiguous, when
     // the second matching volume is found.
-    private static async findVolumes(afsp: string, findFirstMatchingVolume: boolean, folders: string[], pcFolders: string[], log: utils.Log | undefined): Promise<Volume[]> {
+    //
+    // If supplied, filter is an additional test that volume names must pass.
+    private static async findVolumes(afsp: string, findFirstMatchingVolume: boolean, folders: string[], pcFolders: string[], log: utils.Log | undefined, found?: (volume: Volume) => void, filter?: (volumeName: string) => boolean): Promise<Volume[]> {
         const volumes: Volume[] = [];
 
         const re = utils.getRegExpFromAFSP(afsp);
         const ambiguous = utils.isAmbiguousAFSP(afsp);
 
+        function isMatch(volumeName: string): boolean {
+            if (re.exec(volumeName) === null) {
+                return false;
+            }
+
+            if (filter !== undefined && !filter(volumeName)) {
+                return false;
+            }
+
+            return true;
+        }
+
         function isDone(): boolean {
             if (findFirstMatchingVolume) {
                 if (ambiguous) {
@@ -626,86 +1318,145 @@ export class FS {
             return false;
         }
 
-        // returns true if 
-        async function findVolumesMatchingRecursive(folderPath: string, indent: string): Promise<boolean> {
-            if (log !== undefined) {
-                log.pn(indent + 'Looking in: ' + folderPath + '...');
+        // Set once the search is done, so that no further folders get read.
+        let stopped = false;
+
+        let numFolderReads = 0;
+        const folderReadWaiters: (() => void)[] = [];
+
+        async function readFolder(folderPath: string): Promise<fs.Dirent[] | undefined> {
+            while (numFolderReads >= MAX_NUM_CONCURRENT_VOLUME_FOLDER_READS) {
+                await new Promise<void>((resolve) => folderReadWaiters.push(resolve));
             }
 
-            let names: string[];
+            ++numFolderReads;
             try {
-                names = await utils.fsReaddir(folderPath);
+                return await utils.fsReaddirWithFileTypes(folderPath);
             } catch (error) {
-                process.stderr.write('WARNING: failed to read files in folder: ' + folderPath + '\n');
                 if (log !== undefined) {
-                    log.pn('Error was: ' + error);
+                    log.pn('Error reading ' + folderPath + ': ' + error);
                 }
+                return undefined;
+            } finally {
+                --numFolderReads;
+
+                const waiter = folderReadWaiters.shift();
+                if (waiter !== undefined) {
+                    waiter();
+                }
+            }
+        }
+
+        // Only symlinks need a stat.
+        async function isDirectory(folderPath: string, entry: fs.Dirent): Promise<boolean> {
+            if (entry.isDirectory()) {
+                return true;
+            } else if (entry.isSymbolicLink()) {
+                const stat = await utils.tryStat(path.join(folderPath, entry.name));
+                return stat !== undefined && stat.isDirectory();
+            } else {
                 return false;
             }
+        }
+
+        // Each subfolder is read once: its entries decide whether it's a
+        // volume, and, if not, get passed on for searching it in turn.
+        async function scanFolder(folderPath: string, entries: fs.Dirent[] | undefined, indent: string): Promise<IVolumeFolderScan> {
+            const scan: IVolumeFolderScan = { volumes: [], subfolderScans: [] };
+
+            if (stopped) {
+                return scan;
+            }
+
+            if (log !== undefined) {
+                log.pn(indent + 'Looking in: ' + folderPath + '...');
+            }
 
-            const subfolderPaths: string[] = [];
+            if (entries === undefined) {
+                process.stderr.write('WARNING: failed to read files in folder: ' + folderPath + '\n');
+                return scan;
+            }
 
-            let useDir = true;
-            for (const name of names) {
-                if (utils.getCaseNormalizedPath(name) === IGNORE_DIR_FILE_NAME) {
-                    useDir = false;
-                    break;
+            for (const entry of entries) {
+                if (utils.getCaseNormalizedPath(entry.name) === IGNORE_DIR_FILE_NAME) {
+                    return scan;
                 }
             }
 
-            if (useDir) {
-                for (const name of names) {
-                    if (name[0] === '.') {
-                        continue;
-                    }
+            const subfolders = await Promise.all(entries.map(async (entry) => {
+                if (entry.name[0] === '.' || !await isDirectory(folderPath, entry)) {
+                    return undefined;
+                }
 
-                    const fullName = path.join(folderPath, name);
-
-                    const stat = await utils.tryStat(fullName);
-                    if (stat !== undefined && stat.isDirectory()) {
-                        const stat0 = await utils.tryStat(path.join(fullName, '0'));
-                        if (stat0 === undefined) {
-                            // obviously not a BeebLink volume, so save for later.
-                            subfolderPaths.push(fullName);
-                        } else if (stat0.isDirectory()) {
-                            let volumeName: string;
-                            const buffer = await utils.tryReadFile(path.join(fullName, VOLUME_FILE_NAME));
-                            if (buffer !== undefined) {
-                                volumeName = utils.getFirstLine(buffer);
-                            } else {
-                                volumeName = name;
-                            }
+                const fullName = path.join(folderPath, entry.name);
+
+                return { name: entry.name, fullName, entries: await readFolder(fullName) };
+            }));
 
-                            if (FS.isValidVolumeName(volumeName)) {
-                                const volume = new Volume(fullName, volumeName, dfsType);
-                                if (log !== undefined) {
-                                    log.pn('Found volume ' + volume.path + ': ' + volume.name);
-                                }
+            for (const subfolder of subfolders) {
+                if (subfolder === undefined) {
+                    continue;
+                }
 
-                                if (re.exec(volume.name) !== null) {
-                                    volumes.push(volume);
+                const entry0 = subfolder.entries !== undefined ? subfolder.entries.find((entry) => entry.name === '0') : undefined;
+                if (entry0 === undefined) {
+                    // obviously not a BeebLink volume, so search it later.
+                    scan.subfolderScans.push(scanFolder(subfolder.fullName, subfolder.entries, indent + '    '));
+                } else if (await isDirectory(subfolder.fullName, entry0)) {
+                    let volumeName = subfolder.name;
+                    if (subfolder.entries !== undefined && subfolder.entries.find((entry) => utils.getCaseNormalizedPath(entry.name) === VOLUME_FILE_NAME_NORMALIZED) !== undefined) {
+                        const buffer = await utils.tryReadFile(path.join(subfolder.fullName, VOLUME_FILE_NAME));
+                        if (buffer !== undefined) {
+                            volumeName = utils.getFirstLine(buffer);
+                        }
+                    }
 
-                                    if (isDone()) {
-                                        return true;
-                                    }
-                                }
-                            }
+                    if (FS.isValidVolumeName(volumeName)) {
+                        const volume = new Volume(subfolder.fullName, volumeName, dfsType);
+                        if (log !== undefined) {
+                            log.pn('Found volume ' + volume.path + ': ' + volume.name);
                         }
+
+                        scan.volumes.push(volume);
                     }
                 }
+            }
+
+            return scan;
+        }
 
-                for (const subfolderPath of subfolderPaths) {
-                    if (await findVolumesMatchingRecursive(subfolderPath, indent + '    ')) {
+        // Consume scan results in the same order as a sequential depth-first
+        // search would: a folder's volumes, then its subfolders', in
+        // directory order. Returns true once done.
+        async function consumeScan(scanPromise: Promise<IVolumeFolderScan>): Promise<boolean> {
+            const scan = await scanPromise;
+
+            for (const volume of scan.volumes) {
+                if (isMatch(volume.name)) {
+                    volumes.push(volume);
+
+                    if (found !== undefined) {
+                        found(volume);
+                    }
+
+                    if (isDone()) {
                         return true;
                     }
                 }
             }
 
+            for (const subfolderScan of scan.subfolderScans) {
+                if (await consumeScan(subfolderScan)) {
+                    return true;
+                }
+            }
+
             return false;
         }
 
         for (const folder of folders) {
-            if (await findVolumesMatchingRecursive(folder, '')) {
+            if (await consumeScan(scanFolder(folder, await readFolder(folder), ''))) {
+                stopped = true;
                 return volumes;
             }
         }
@@ -713,10 +1464,14 @@ export class FS {
         for (const pcFolder of pcFolders) {
             const volumeName = path.basename(pcFolder);
             if (FS.isValidVolumeName(volumeName)) {
-                if (re.exec(volumeName) !== null) {
+                if (isMatch(volumeName)) {
                     const volume = new Volume(pcFolder, volumeName, pcType);
                     volumes.push(volume);
 
+                    if (found !== undefined) {
+                        found(volume);
+                    }
+
                     if (isDone()) {
                         return volumes;
                     }
@@ -777,12 +1532,16 @@ export class FS {
     private state: IFSState | undefined;
     private defaults: any | undefined;
 
-    private gaManipulator: gitattributes.Manipulator | undefined;
+    private gaManipulator: gitattributes.IManipulator | undefined;
+
+    private volumeRegistry: VolumeRegistry;
+
+    private sharing: IFSSharing | undefined;
 
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
-    public constructor(logPrefix: string | undefined, folders: string[], pcFolders: string[], colours: Chalk | undefined, gaManipulator: gitattributes.Manipulator | undefined) {
+    public constructor(logPrefix: string | undefined, folders: string[], pcFolders: string[], colours: Chalk | undefined, gaManipulator: gitattributes.IManipulator | undefined, volumeRegistry: VolumeRegistry, sharing: IFSSharing | undefined) {
         this.log = new utils.Log(logPrefix !== undefined ? logPrefix : '', process.stdout, logPrefix !== undefined);
         this.log.colours = colours;
 
@@ -798,6 +1557,11 @@ export class FS {
         }
 
         this.gaManipulator = gaManipulator;
+        this.volumeRegistry = volumeRegistry;
+        this.sharing = sharing;
+        if (sharing !== undefined) {
+            gSharings.add(sharing);
+        }
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -938,9 +1702,33 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
-    // Finds all volumes matching the given afsp.
+    // Finds all volumes matching the given afsp. A search for '*' refreshes the
+    // volume registry as a side-effect.
+    //
+    // While the initial volume scan is still running, the results come from
+    // the volume registry, and may be incomplete.
     public async findAllVolumesMatching(afsp: string): Promise<Volume[]> {
-        return await FS.findVolumes(afsp, false, this.folders, this.pcFolders, undefined);
+        if (!this.volumeRegistry.isComplete()) {
+            const re = utils.getRegExpFromAFSP(afsp);
+            return this.volumeRegistry.getVolumes().filter((volume) => re.exec(volume.name) !== null);
+        }
+
+        const volumes = await FS.findVolumes(afsp, false, this.folders, this.pcFolders, undefined);
+
+        if (afsp === '*') {
+            this.volumeRegistry.set(volumes);
+        }
+
+        return volumes;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Gets the volume registry, which holds every volume found so far, sorted
+    // by name. Unlike findAllVolumesMatching, this doesn't touch the disk.
+    public getVolumeRegistry(): VolumeRegistry {
+        return this.volumeRegistry;
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -988,6 +1776,12 @@ export class FS {
         }
 
         const newVolume = new Volume(volumePath, name, dfsType);
+        this.volumeRegistry.add(newVolume);
+
+        if (this.sharing !== undefined) {
+            this.sharing.volumeCreated(newVolume);
+        }
+
         return newVolume;
     }
 
@@ -1077,7 +1871,7 @@ export class FS {
                 text += 'out';
             }
 
-            text += ' PTR#=&' + utils.hex8(openFile.ptr) + ' EXT#=&' + utils.hex8(openFile.contents.length) + ' - ' + openFile.hostPath + utils.BNL;
+            text += ' PTR#=&' + utils.hex8(openFile.ptr) + ' EXT#=&' + utils.hex8(openFile.contents.getLength()) + ' - ' + openFile.hostPath + utils.BNL;
         }
 
         if (!anyOpen) {
@@ -1112,7 +1906,7 @@ export class FS {
     public eof(handle: number): boolean {
         const openFile = this.mustBeOpen(this.getOpenFileByHandle(handle));
 
-        return openFile.ptr >= openFile.contents.length;
+        return openFile.ptr >= openFile.contents.getLength();
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -1121,8 +1915,8 @@ export class FS {
     public OSBGET(handle: number): number | undefined {
         const openFile = this.mustBeOpen(this.getOpenFileByHandle(handle));
 
-        if (openFile.ptr < openFile.contents.length) {
-            return openFile.contents[openFile.ptr++];
+        if (openFile.ptr < openFile.contents.getLength()) {
+            return openFile.contents.getByte(openFile.ptr++);
         } else {
             if (openFile.eofError) {
                 return errors.eof();
@@ -1254,27 +2048,29 @@ export class FS {
                 FS.mustBeWriteableFile(file);
             }
 
-            if (write && !read) {
-                // OPENOUT of file that exists. Zap the contents first.
-                try {
-                    await utils.fsTruncate(file.hostPath);
-                } catch (error) {
-                    return errors.nodeError(error as NodeJS.ErrnoException);
+            // Lock before touching the file, in case another server process
+            // has it open.
+            await this.mustLockFile(hostPath, write);
+            try {
+                if (write && !read) {
+                    // OPENOUT of file that exists. Zap the contents first.
+                    try {
+                        await utils.fsTruncate(file.hostPath);
+                    } catch (error) {
+                        return errors.nodeError(error as NodeJS.ErrnoException);
+                    } finally {
+                        bumpWriteGeneration(file.hostPath);
+                    }
                 }
-            }
 
-            if (file.text) {
-                // Not efficient, but I don't think it matters...
-                const lines = await this.readTextFile(file);
-
-                let linesString = '';
-                for (const line of lines) {
-                    linesString += line + '\x0d';
+                if (file.text) {
+                    contentsBuffer = await this.readTextFileForOSFIND(file);
+                } else {
+                    contentsBuffer = await FS.readFile(file);
                 }
-
-                contentsBuffer = Buffer.from(linesString, 'binary');
-            } else {
-                contentsBuffer = await FS.readFile(file);
+            } catch (error) {
+                this.unlockFile(hostPath, write);
+                throw error;
             }
         } else {
             // File doesn't exist.
@@ -1283,21 +2079,28 @@ export class FS {
                 return 0;
             }
 
+            FS.mustBeWriteableVolume(fqn.volume);
+
             hostPath = this.getHostPath(fqn);
             await errors.mustNotExist(hostPath);
 
-            // Create file.
-            await this.OSFILECreate(fqn, 0, 0, 0);
-        }
-
-        const contents: number[] = [];
-        if (contentsBuffer !== undefined) {
-            for (const byte of contentsBuffer) {
-                contents.push(byte);
+            await this.mustLockFile(hostPath, write);
+            try {
+                // Create file.
+                await this.writeBeebData(hostPath, fqn, new SparseData(undefined, 0));
+                await this.writeBeebMetadata(hostPath, fqn, 0, 0, DEFAULT_ATTR);
+            } catch (error) {
+                this.unlockFile(hostPath, write);
+                throw error;
             }
         }
 
-        this.openFiles[index] = new OpenFile(hostPath, fqn, read, write, contents);
+        const contents = new SparseData(contentsBuffer);
+
+        const openFile = new OpenFile(hostPath, fqn, read, write, contents, file !== undefined && file.text);
+        openFile.setDiskStat(await utils.tryStat(hostPath));
+
+        this.openFiles[index] = openFile;
         const handle = this.firstFileHandle + index;
         this.log.pn(`        handle=0x${handle}`);
         return handle;
@@ -1364,6 +2167,37 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
+    // Same line ending rules as readTextFile, but produces the file contents
+    // with each line terminated by CR.
+    private async readTextFileForOSFIND(file: File): Promise<Buffer> {
+        const stat = await utils.tryStat(file.hostPath);
+        if (stat !== undefined) {
+            const cached = gCachedTextFileByHostPath.get(file.hostPath);
+            if (cached !== undefined && cached.size === stat.size && cached.mtimeMs === stat.mtimeMs) {
+                this.log.pn('        (using cached text file contents)');
+                return cached.contents;
+            }
+        }
+
+        const contents = utils.getTextFileWithCRLineEndings(await FS.readFile(file));
+
+        gCachedTextFileByHostPath.delete(file.hostPath);
+
+        if (stat !== undefined) {
+            while (gCachedTextFileByHostPath.size >= MAX_NUM_CACHED_TEXT_FILES) {
+                const oldestHostPath = gCachedTextFileByHostPath.keys().next().value;
+                gCachedTextFileByHostPath.delete(oldestHostPath);
+            }
+
+            gCachedTextFileByHostPath.set(file.hostPath, new CachedTextFile(stat.size, stat.mtimeMs, contents));
+        }
+
+        return contents;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
     // get BeebFile matching FQN, or throw a NotFound. If FQN has wildcards,
     // that's fine, but it's a BadName/'Ambiguous name' if multiple files are
     // matched.
@@ -1393,6 +2227,78 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
+    // Save data to a file, replacing any existing one, as per OSFILE A=0.
+    public async saveFile(fqn: FQN, load: number, exec: number, data: Buffer): Promise<void> {
+        await this.OSFILESave(fqn, load, exec, data);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Write back a disc image attached with *VDRIVE. The file is looked up
+    // again, in case it's been deleted or renamed since, and the usual
+    // checks apply, as for a save - except that a file open for read on this
+    // connection is fine.
+    public async writeDiscImage(file: File, data: Buffer): Promise<void> {
+        FS.mustBeWriteableVolume(file.fqn.volume);
+        FS.mustNotBeTooBig(data.length);
+
+        const current = await getBeebFile(file.fqn, false, false);
+        if (current === undefined || current.hostPath !== file.hostPath) {
+            return errors.fileNotFound();
+        }
+
+        this.mustNotBeOpenForWrite(current);
+        FS.mustBeWriteableFile(current);
+
+        await this.withWriteLock(current.hostPath, async (): Promise<void> => {
+            await this.writeBeebData(current.hostPath, current.fqn, data);
+        });
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Append data to a file, creating it if it doesn't exist. The usual
+    // checks apply, as for a save.
+    public async appendToFile(fqn: FQN, data: Buffer): Promise<void> {
+        const file = await this.getBeebFileForWrite(fqn);
+
+        const stat = await utils.tryStat(file.hostPath);
+        FS.mustNotBeTooBig((stat !== undefined ? stat.size : 0) + data.length);
+
+        await this.withWriteLock(file.hostPath, async (): Promise<void> => {
+            try {
+                if (stat === undefined) {
+                    await utils.fsMkdirAndWriteFile(file.hostPath, data);
+                } else {
+                    await utils.fsAppendFile(file.hostPath, data);
+                }
+            } catch (error) {
+                return errors.nodeError(error);
+            } finally {
+                bumpWriteGeneration(file.hostPath);
+            }
+
+            forgetFingerprint(file.hostPath);
+
+            // Only a new file needs setting up. Appends are frequent, e.g.,
+            // one per printer buffer, and the rest would be the same each
+            // time.
+            if (stat === undefined) {
+                await this.writeBeebMetadata(file.hostPath, fqn, file.load, file.exec, DEFAULT_ATTR);
+
+                if (this.gaManipulator !== undefined) {
+                    this.gaManipulator.makeVolumeNotText(fqn.volume);
+                    this.gaManipulator.makeFileBASIC(file.hostPath, false);
+                }
+            }
+        });
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
     public async OPT(x: number, y: number): Promise<void> {
         if (x === 4) {
             const state = this.getState();
@@ -1418,11 +2324,15 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
 
     public async writeBeebFileMetadata(file: File): Promise<void> {
-        try {
-            await this.writeBeebMetadata(file.hostPath, file.fqn, file.load, file.exec, file.attr);
-        } catch (error) {
-            errors.nodeError(error);
-        }
+        this.mustNotBeOpen(file);
+
+        await this.withWriteLock(file.hostPath, async (): Promise<void> => {
+            try {
+                await this.writeBeebMetadata(file.hostPath, file.fqn, file.load, file.exec, file.attr);
+            } catch (error) {
+                errors.nodeError(error);
+            }
+        });
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -1466,12 +2376,25 @@ export class FS {
             return errors.fileNotFound();
         }
 
-        await oldFQN.volume.type.renameFile(oldFile, newFQN);
+        this.mustNotBeOpen(oldFile);
+
+        const newHostPath = newFQN.volume.type.getHostPath(newFQN.fsFQN);
+
+        await this.withWriteLock(oldFile.hostPath, async (): Promise<void> => {
+            await this.withWriteLock(newHostPath, async (): Promise<void> => {
+                try {
+                    await oldFQN.volume.type.renameFile(oldFile, newFQN);
+                } finally {
+                    bumpWriteGeneration(oldFile.hostPath);
+                    bumpWriteGeneration(newHostPath);
+                }
+            });
+        });
 
         if (this.gaManipulator !== undefined) {
             if (!newFQN.volume.isReadOnly()) {
                 // could be cleverer than this.
-                this.gaManipulator.renameFile(oldFile.hostPath, newFQN.volume.type.getHostPath(newFQN.fsFQN));
+                this.gaManipulator.renameFile(oldFile.hostPath, newHostPath);
             }
         }
     }
@@ -1519,6 +2442,170 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
+    // Produce a JSON-friendly snapshot of the current state. Nothing is
+    // written to disk: unflushed changes to open files go in the checkpoint,
+    // and stay unflushed after a restore. The rest of each open file is
+    // re-read from disk on restore, so isn't included.
+    public getCheckpoint(): IFSCheckpoint {
+        let volume: IVolumeCheckpoint | null = null;
+        let settings: any = null;
+        if (this.state !== undefined) {
+            volume = getVolumeJSON(this.state.volume);
+            settings = this.state.getSettings();
+        }
+
+        const openFiles: (IOpenFileCheckpoint | null)[] = [];
+        for (const openFile of this.openFiles) {
+            if (openFile === undefined) {
+                openFiles.push(null);
+            } else {
+                const dirtyPages: { [pageIdx: string]: string | null } = {};
+                for (const [pageIdx, page] of openFile.contents.getDirtyPages()) {
+                    dirtyPages[pageIdx] = page !== undefined ? page.toString('base64') : null;
+                }
+
+                openFiles.push({
+                    hostPath: openFile.hostPath,
+                    fqn: openFile.fqn.toString(),
+                    read: openFile.read,
+                    write: openFile.write,
+                    ptr: openFile.ptr,
+                    eofError: openFile.eofError,
+                    text: openFile.text,
+                    diskSize: openFile.diskSize,
+                    diskMtimeMs: openFile.diskMtimeMs,
+                    size: openFile.contents.getLength(),
+                    dirty: openFile.dirty,
+                    dirtyPages,
+                });
+            }
+        }
+
+        return {
+            volume,
+            settings: settings !== undefined ? settings : null,
+            defaults: this.defaults !== undefined ? this.defaults : null,
+            firstFileHandle: this.firstFileHandle,
+            openFiles,
+        };
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Restore state from a checkpoint produced by getCheckpoint, presumably by
+    // a previous run of the server. Any open files are discarded first.
+    //
+    // The volume must still exist. Open files are only restored if the file
+    // on disk hasn't changed since the checkpoint.
+    public async restoreCheckpoint(checkpoint: IFSCheckpoint): Promise<void> {
+        bumpWriteGeneration(undefined);
+
+        this.openFiles = [];
+        this.firstFileHandle = checkpoint.firstFileHandle;
+        for (let i = 0; i < checkpoint.openFiles.length; ++i) {
+            this.openFiles.push(undefined);
+        }
+
+        if (checkpoint.volume === null) {
+            return;
+        }
+
+        const type = gFSTypeByName.get(checkpoint.volume.type);
+        if (type === undefined) {
+            return errors.generic(`Unknown volume type: ${checkpoint.volume.type}`);
+        }
+
+        const stat = await utils.tryStat(checkpoint.volume.path);
+        if (stat === undefined || !stat.isDirectory()) {
+            return errors.fileNotFound('Volume not found');
+        }
+
+        let volume = new Volume(checkpoint.volume.path, checkpoint.volume.name, type);
+        if (checkpoint.volume.readOnly) {
+            volume = volume.asReadOnly();
+        }
+
+        this.state = type.createState(volume, type.createSettings(checkpoint.settings), this.log);
+        this.defaults = type.createSettings(checkpoint.defaults);
+
+        for (let index = 0; index < checkpoint.openFiles.length; ++index) {
+            const c = checkpoint.openFiles[index];
+            if (c !== null) {
+                // The FS-specific part of an FQN string starts after the
+                // volume name, same as when parsing the ::VOLUME syntax.
+                const fsFSP = type.parseFileOrDirString(c.fqn, 2 + volume.name.length, false);
+                const fqn = new FQN(volume, type.createFQN(fsFSP, undefined));
+
+                if (this.sharing !== undefined) {
+                    if (!await this.sharing.lockFile(c.hostPath, c.write)) {
+                        this.log.pn(`Not restoring handle 0x${utils.hex2(this.firstFileHandle + index)}: ${c.fqn} - open elsewhere`);
+                        continue;
+                    }
+                }
+
+                const openFile = await this.tryRestoreOpenFile(c, fqn);
+                if (openFile === undefined) {
+                    this.log.pn(`Not restoring handle 0x${utils.hex2(this.firstFileHandle + index)}: ${c.fqn} - changed on disk`);
+                    this.unlockFile(c.hostPath, c.write);
+                    continue;
+                }
+
+                this.openFiles[index] = openFile;
+                this.log.pn(`Restored handle 0x${utils.hex2(this.firstFileHandle + index)}: ${fqn}`);
+            }
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
+    // Rebuild an open file from its checkpoint: whatever's on disk, plus the
+    // unflushed pages. Returns undefined if the file on disk isn't the one
+    // the checkpoint was based on.
+    private async tryRestoreOpenFile(c: IOpenFileCheckpoint, fqn: FQN): Promise<OpenFile | undefined> {
+        const stat = await utils.tryStat(c.hostPath);
+        const diskSize = stat !== undefined ? stat.size : -1;
+        const diskMtimeMs = stat !== undefined ? stat.mtimeMs : -1;
+        if (diskSize !== c.diskSize || diskMtimeMs !== c.diskMtimeMs) {
+            return undefined;
+        }
+
+        let data: Buffer | undefined;
+        if (stat !== undefined) {
+            data = await utils.tryReadFile(c.hostPath);
+            if (data === undefined) {
+                return undefined;
+            }
+
+            if (c.text) {
+                data = utils.getTextFileWithCRLineEndings(data);
+            }
+        }
+
+        const contents = new SparseData(data);
+        contents.setLength(c.size);
+        contents.clearDirtyPages();
+        for (const pageIdx of Object.keys(c.dirtyPages)) {
+            const page = c.dirtyPages[pageIdx];
+            contents.setPage(Number(pageIdx), page !== null ? Buffer.from(page, 'base64') : undefined);
+        }
+
+        const openFile = new OpenFile(c.hostPath, fqn, c.read, c.write, contents, c.text);
+        openFile.ptr = c.ptr;
+        openFile.eofError = c.eofError;
+        openFile.diskSize = c.diskSize;
+        openFile.diskMtimeMs = c.diskMtimeMs;
+        if (c.dirty) {
+            openFile.markDirty();
+        }
+
+        return openFile;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
     private getHostPath(fqn: FQN): string {
         return path.join(fqn.volume.path, fqn.volume.type.getHostPath(fqn.fsFQN));
     }
@@ -1566,41 +2653,73 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
-    private async OSFILESave(fqn: FQN, load: number, exec: number, data: Buffer): Promise<OSFILEResult> {
+    private async OSFILESave(fqn: FQN, load: number, exec: number, data: Buffer | SparseData): Promise<OSFILEResult> {
+        const size = data instanceof SparseData ? data.getLength() : data.length;
+
         FS.mustBeWriteableVolume(fqn.volume);
-        FS.mustNotBeTooBig(data.length);
+        FS.mustNotBeTooBig(size);
 
         let hostPath: string;
 
+        const attr = DEFAULT_ATTR;
+        let metadataUnchanged = false;
+
         const file = await getBeebFile(fqn, false, false, this.log);
         if (file !== undefined) {
             this.mustNotBeOpen(file);
             FS.mustBeWriteableFile(file);
 
             hostPath = file.hostPath;
+
+            metadataUnchanged = FS.isSameMetadata(file, fqn, load, exec, attr);
         } else {
             hostPath = this.getHostPath(fqn);
 
             await errors.mustNotExist(hostPath);
         }
 
-        const attr = DEFAULT_ATTR;
-        await this.writeBeebData(hostPath, fqn, data);
-        await this.writeBeebMetadata(hostPath, fqn, load, exec, attr);
+        await this.withWriteLock(hostPath, async (): Promise<void> => {
+            await this.writeBeebData(hostPath, fqn, data);
+
+            if (metadataUnchanged) {
+                this.log.pn(`        metadata unchanged: ${hostPath}`);
+            } else {
+                await this.writeBeebMetadata(hostPath, fqn, load, exec, attr);
+            }
+        });
 
-        return new OSFILEResult(1, this.createOSFILEBlock(load, exec, data.length, attr), undefined, undefined);
+        return new OSFILEResult(1, this.createOSFILEBlock(load, exec, size, attr), undefined, undefined);
     }
 
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
-    private async writeBeebData(hostPath: string, fqn: FQN, data: Buffer): Promise<void> {
-        await writeFile(hostPath, data);
+    private async writeBeebData(hostPath: string, fqn: FQN, data: Buffer | SparseData): Promise<void> {
+        let written: boolean;
+        if (data instanceof SparseData) {
+            written = await writeSparseFile(hostPath, data);
+        } else {
+            written = await writeFile(hostPath, data);
+        }
+
+        if (!written) {
+            this.log.pn(`        data unchanged: ${hostPath}`);
+            return;
+        }
 
         if (this.gaManipulator !== undefined) {
             if (!fqn.volume.isReadOnly()) {
+                let isBASIC: boolean;
+                if (data instanceof SparseData) {
+                    // A BASIC program has to fit in the Beeb's memory, so
+                    // there's no need to look any further than this.
+                    isBASIC = utils.isBASIC(data.read(0, Math.min(data.getLength(), 65536)));
+                } else {
+                    isBASIC = utils.isBASIC(data);
+                }
+
                 this.gaManipulator.makeVolumeNotText(fqn.volume);
-                this.gaManipulator.makeFileBASIC(hostPath, utils.isBASIC(data));
+                this.gaManipulator.makeFileBASIC(hostPath, isBASIC);
             }
         }
     }
@@ -1609,7 +2728,11 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
 
     private async writeBeebMetadata(hostPath: string, fqn: FQN, load: number, exec: number, attr: number): Promise<void> {
-        await fqn.volume.type.writeBeebMetadata(hostPath, fqn.fsFQN, load, exec, attr);
+        try {
+            await fqn.volume.type.writeBeebMetadata(hostPath, fqn.fsFQN, load, exec, attr);
+        } finally {
+            bumpWriteGeneration(hostPath);
+        }
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -1655,7 +2778,13 @@ export class FS {
 
         const fileSize = await this.tryGetFileSize(file);
 
-        await this.writeBeebMetadata(file.hostPath, file.fqn, load, exec, attr);
+        if (!FS.isSameMetadata(file, file.fqn, load, exec, attr)) {
+            this.mustNotBeOpen(file);
+
+            await this.withWriteLock(file.hostPath, async (): Promise<void> => {
+                await this.writeBeebMetadata(file.hostPath, file.fqn, load!, exec!, attr!);
+            });
+        }
 
         return new OSFILEResult(1, this.createOSFILEBlock(load, exec, fileSize, attr), undefined, undefined);
     }
@@ -1698,7 +2827,13 @@ export class FS {
         this.mustNotBeOpen(file);
         FS.mustBeWriteableFile(file);
 
-        await file.fqn.volume.type.deleteFile(file);
+        await this.withWriteLock(file.hostPath, async (): Promise<void> => {
+            try {
+                await file.fqn.volume.type.deleteFile(file);
+            } finally {
+                bumpWriteGeneration(file.hostPath);
+            }
+        });
 
         if (this.gaManipulator !== undefined) {
             this.gaManipulator.deleteFile(file.hostPath);
@@ -1712,8 +2847,8 @@ export class FS {
         FS.mustBeWriteableVolume(fqn.volume);
         FS.mustNotBeTooBig(size);//block.attr - block.size);
 
-        // Cheat.
-        return await this.OSFILESave(fqn, load, exec, Buffer.alloc(size));
+        // Cheat. The file is all hole, so it's extended rather than written.
+        return await this.OSFILESave(fqn, load, exec, new SparseData(undefined, size));
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -1733,6 +2868,21 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
+    // Causes an 'Open' error if the given file is open for write, and so the
+    // data on disk might be out of date.
+    public mustNotBeOpenForWrite(file: File): void {
+        for (const openFile of this.openFiles) {
+            if (openFile !== undefined) {
+                if (openFile.hostPath === file.hostPath && openFile.write) {
+                    return errors.open();
+                }
+            }
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
     // Causes a 'Read only' error if the given file isn't open for write.
     private mustBeOpenForWrite(openFile: OpenFile): void {
         if (!openFile.write) {
@@ -1763,7 +2913,13 @@ export class FS {
             return;
         }
 
-        await this.flushOpenFile(openFile);
+        try {
+            await this.flushOpenFile(openFile);
+        } finally {
+            if (this.sharing !== undefined) {
+                this.sharing.unlockFile(openFile.hostPath, openFile.write);
+            }
+        }
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -1805,13 +2961,51 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////////////////
 
+    // Take the cross-process lock for a file, if there's anybody else to
+    // share with. 'Open' error if somebody else has it.
+    private async mustLockFile(hostPath: string, write: boolean): Promise<void> {
+        if (this.sharing !== undefined) {
+            if (!await this.sharing.lockFile(hostPath, write)) {
+                this.log.pn(`        already open by another server process: ${hostPath}`);
+                return errors.open();
+            }
+        }
+    }
+
+    private unlockFile(hostPath: string, write: boolean): void {
+        if (this.sharing !== undefined) {
+            this.sharing.unlockFile(hostPath, write);
+        }
+    }
+
+    // Hold the write lock while doing something to a file, so it doesn't
+    // happen while another server process has it open.
+    private async withWriteLock<T>(hostPath: string, fun: () => Promise<T>): Promise<T> {
+        await this.mustLockFile(hostPath, true);
+        try {
+            return await fun();
+        } finally {
+            this.unlockFile(hostPath, true);
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////
+
     private async flushOpenFile(openFile: OpenFile): Promise<void> {
         if (openFile.dirty) {
-            const data = Buffer.from(openFile.contents);
+            const numModifications = openFile.numModifications;
 
-            await this.writeBeebData(openFile.hostPath, openFile.fqn, data);
+            await this.writeBeebData(openFile.hostPath, openFile.fqn, openFile.contents);
 
-            openFile.dirty = false;
+            openFile.setDiskStat(await utils.tryStat(openFile.hostPath));
+
+            // Anything written by another request in the meantime still needs
+            // flushing.
+            if (openFile.numModifications === numModifications) {
+                openFile.dirty = false;
+                openFile.contents.clearDirtyPages();
+            }
         }
     }
 
@@ -1830,12 +3024,12 @@ export class FS {
     private OSARGSSetPtr(handle: number, ptr: number) {
         const openFile = this.mustBeOpen(this.getOpenFileByHandle(handle));
 
-        if (ptr > openFile.contents.length) {
+        if (ptr > openFile.contents.getLength()) {
             this.mustBeOpenForWrite(openFile);
+            FS.mustNotBeTooBig(ptr);
 
-            while (openFile.contents.length < ptr) {
-                openFile.contents.push(0);
-            }
+            openFile.contents.setLength(ptr);
+            openFile.markDirty();
         }
 
         openFile.ptr = ptr;
@@ -1848,7 +3042,7 @@ export class FS {
     private OSARGSGetSize(handle: number): number {
         const openFile = this.mustBeOpen(this.getOpenFileByHandle(handle));
 
-        return openFile.contents.length;
+        return openFile.contents.getLength();
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -1858,13 +3052,11 @@ export class FS {
         const openFile = this.mustBeOpen(this.getOpenFileByHandle(handle));
 
         this.mustBeOpenForWrite(openFile);
+        FS.mustNotBeTooBig(size);
 
-        if (size < openFile.contents.length) {
-            openFile.contents.splice(size);
-        } else {
-            while (openFile.contents.length < size) {
-                openFile.contents.push(0);
-            }
+        if (size !== openFile.contents.getLength()) {
+            openFile.contents.setLength(size);
+            openFile.markDirty();
         }
     }
 
@@ -1924,16 +3116,15 @@ export class FS {
 
         let numBytesLeft = 0;
         let eof = false;
-        if (ptr + numBytes > openFile.contents.length) {
+        if (ptr + numBytes > openFile.contents.getLength()) {
             eof = true;
-            numBytesLeft = ptr + numBytes - openFile.contents.length;
-            numBytes = openFile.contents.length - ptr;
+            numBytesLeft = ptr + numBytes - openFile.contents.getLength();
+            numBytes = openFile.contents.getLength() - ptr;
         }
 
-        const data = Buffer.alloc(numBytes);
-        for (let i = 0; i < data.length; ++i) {
-            data[i] = openFile.contents[ptr + i];
-        }
+        // The response is sent before the next request can modify the
+        // contents, so there's no need to copy.
+        const data = openFile.contents.readSlices(ptr, numBytes);
 
         openFile.ptr = ptr + numBytes;
 
@@ -2007,18 +3198,14 @@ export class FS {
     /////////////////////////////////////////////////////////////////////////
 
     private bputInternal(openFile: OpenFile, byte: number): void {
-        if (openFile.ptr >= openFile.contents.length) {
-            if (openFile.contents.length >= MAX_FILE_SIZE) {
-                return errors.tooBig();
-            }
-
-            openFile.contents.push(byte);
-        } else {
-            openFile.contents[openFile.ptr] = byte;
+        if (openFile.ptr >= MAX_FILE_SIZE) {
+            return errors.tooBig();
         }
 
+        openFile.contents.setByte(openFile.ptr, byte);
+
         ++openFile.ptr;
-        openFile.dirty = true;
+        openFile.markDirty();
     }
 
     /////////////////////////////////////////////////////////////////////////
@@ -365,6 +365,31 @@ export const REQUEST_SET_LAST_DISK_IMAGE_OSWORD_RESULT = 0x1e;
 
 export const REQUEST_FINISH_DISK_IMAGE_FLOW = 0x1f;
 
+// Disc OSWORD (&72 or &7F), offered to the server in case it has a disc image
+// attached to the drive in question.
+//
+// P = 1 byte OSWORD number; 16 bytes parameter block; data to write, if a
+// write. (Write size is 256 bytes per sector, whatever the sector size - or,
+// for OSWORD &72 with a sector count of 0, the byte count at +11.)
+//
+// Response is NO if the server isn't handling the OSWORD, in which case it
+// should be passed on as usual; or DISC_OSWORD if it is.
+export const REQUEST_DISC_OSWORD = 0x20;
+
+// Printer output captured by *BLPRINT, to be appended to the print file.
+//
+// P = the bytes
+export const REQUEST_PRINT = 0x21;
+
+// Get the delay to use before each byte of a slow read, as set with the
+// server's --slow-read-delay option.
+//
+// Response is DATA with 1 byte, the number of ~17 cycle iterations; or NO, if
+// the ROM should use its default for the link.
+//
+// P = ignored
+export const REQUEST_GET_SLOW_READ_DELAY = 0x22;
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
@@ -390,7 +415,7 @@ export const REQUEST_AVR_ERROR = 1;
 
 // Request a reset.
 //
-// Response is TEXT.
+// Response is VOLUME_BROWSER, as for REQUEST_VOLUME_BROWSER_KEYPRESS.
 //
 // P = 1 byte, display memory type (as per &34f); 1 byte, text display width; 1
 // byte, text display height
@@ -406,7 +431,8 @@ export const REQUEST_VOLUME_BROWSER_RESET = 0;
 // buffer, and sometimes it isn't.
 //
 // P = 1 byte, SHIFT pressed flag (0=no, yes otherwise); 1 byte, the ASCII key
-// value assuming *FX4,1
+// value assuming *FX4,1; 1 byte, local cursor row (ignored if the last response
+// had no local cursor info)
 export const REQUEST_VOLUME_BROWSER_KEYPRESS = 1;
 
 /////////////////////////////////////////////////////////////////////////
@@ -529,9 +555,17 @@ export const RESPONSE_SPECIAL = 0x0f;
 
 // Some kind of volume browser-related response.
 //
-// P = 1 byte, the exact respones type.
+// P = 1 byte, the exact respones type; then, optionally, 6 bytes of local
+// cursor info (see VOLUME_BROWSER_LOCAL_CURSOR_xxx below). Missing bytes should
+// be treated as 0.
 export const RESPONSE_VOLUME_BROWSER = 0x10;
 
+// Disc OSWORD handled.
+//
+// P = 16 bytes updated parameter block, including the result; then the data
+// read, if a read. The data address is as per the parameter block.
+export const RESPONSE_DISC_OSWORD = 0x11;
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
@@ -563,6 +597,11 @@ export const RESPONSE_SPECIAL_SRLOAD = 6;
 // P = none
 export const RESPONSE_SPECIAL_DISK_IMAGE_FLOW = 7;
 
+// Start or stop capturing printer output.
+//
+// P = 1 byte: non-zero to start, 0 to stop
+export const RESPONSE_SPECIAL_PRINTER = 8;
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
@@ -589,6 +628,35 @@ export const RESPONSE_VOLUME_BROWSER_PRINT_STRING_AND_FLUSH_KEYBOARD_BUFFER = 5;
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Volume browser local cursor types.
+//
+// The local cursor info lets the ROM move the highlight up and down the
+// current column without a round trip. It's 1 byte, the type; 1 byte, text X
+// of the column; 1 byte, current row; 1 byte, number of rows in the column; 1
+// byte, normal foreground colour; 1 byte, highlighted foreground colour.
+//
+// The ROM reads the names back off the screen with OSBYTE 135 when redrawing
+// them. The server only supplies local cursor info when the whole column is
+// visible, with at least one free char to its right.
+//
+// When the ROM moves the cursor, it reports the new row in its next
+// REQUEST_VOLUME_BROWSER_KEYPRESS.
+
+// No local cursor. The ROM must send every key to the server.
+export const VOLUME_BROWSER_LOCAL_CURSOR_NONE = 0;
+
+// Bitmap mode. Normal names are drawn with background colour 128, highlighted
+// ones with background colour 129.
+export const VOLUME_BROWSER_LOCAL_CURSOR_BITMAP = 1;
+
+// Teletext mode. The 3 chars to the left of a name are 32,135,156 for normal
+// names, and 132,157,131 for highlighted ones; highlighted names are also
+// followed by 32,135,156. Colour bytes are unused.
+export const VOLUME_BROWSER_LOCAL_CURSOR_TELETEXT = 2;
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 // 4351 = 4096 (ADFS track size) + 255 (space for additional stuff)
 // - the make_constants script is not clever enough to understand expressions.
 //
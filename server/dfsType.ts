@@ -410,6 +410,20 @@ class DFSType implements beebfs.IFSType {
         return new DFSState(volume, settings, log);
     }
 
+    public createSettings(json: any): DFSSettings | undefined {
+        if (json === null || typeof json !== 'object') {
+            return undefined;
+        }
+
+        for (const value of [json.drive, json.dir, json.libDrive, json.libDir]) {
+            if (typeof value !== 'string' || value.length !== 1) {
+                return undefined;
+            }
+        }
+
+        return new DFSSettings(json.drive, json.dir, json.libDrive, json.libDir);
+    }
+
     public canWrite(): boolean {
         return true;
     }
@@ -28,18 +28,138 @@
 import * as path from 'path';
 import * as utils from './utils';
 import * as beebfs from './beebfs';
+import * as fs from 'fs';
 
-export class Manipulator {
+// Max number of files scanForBASIC will stat/read at once.
+const SCAN_FOR_BASIC_MAX_PARALLELISM = 8;
+
+const BASIC_CACHE_VERSION = 1;
+
+// A pending edit to a .gitattributes file. basename is unescaped.
+interface IEdit {
+    basename: string;
+
+    // Attribute to remove, if any.
+    remove?: string;
+
+    // Attribute to add, if any.
+    add?: string;
+
+    // If set, remove all lines for basename.
+    delete?: boolean;
+
+    // If set, change lines for basename to refer to this instead.
+    newBasename?: string;
+
+    // Called once the lines for basename have been deleted, with the
+    // attributes that were removed.
+    deleted?: (attrs: string[]) => void;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// What scanForBASIC found out about a file last time. If the size and mtime
+// still match, there's no need to read the file again.
+interface IBASICCacheEntry {
+    size: number;
+    mtimeMs: number;
+    basic: boolean;
+}
+
+// BASIC cache file contents. Each entry is [size, mtimeMs, basic (0 or 1)],
+// keyed by host path.
+interface IBASICCacheFile {
+    version: number;
+    entries: { [hostPath: string]: [number, number, number] };
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// https://git-scm.com/docs/gitignore
+function getPattern(basename: string): string {
+    if (basename[0] === '#' || basename[0] === '!') {
+        return '\\' + basename;
+    } else {
+        return basename;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// The .gitattributes updates that FS makes. In a --serial-worker process,
+// these are forwarded to the supervisor's Manipulator - see workers.ts.
+export interface IManipulator {
+    makeVolumeNotText(volume: beebfs.Volume): void;
+    deleteFile(filePath: string): void;
+    renameFile(oldFilePath: string, newFilePath: string): void;
+    makeFileBASIC(filePath: string, basic: boolean): void;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+export class Manipulator implements IManipulator {
     private queue: (() => Promise<void>)[];
     private log: utils.Log;
     private extraVerbose: boolean = false;
     private quiescentCallbacks: (() => void)[];
     private completionMessage: string | undefined;
 
-    public constructor(verbose: boolean) {
+    // Edits not yet applied, by .gitattributes path. Each path gets one
+    // queue entry, which applies everything outstanding for that file in one
+    // go.
+    private pendingEditsByGAPath: Map<string, IEdit[]>;
+
+    // If basicCachePath is undefined, the cache isn't saved.
+    private basicCachePath: string | undefined;
+    private basicCache: Map<string, IBASICCacheEntry>;
+    private basicCacheDirty: boolean;
+    private basicCacheSaving: boolean;
+
+    public constructor(verbose: boolean, basicCachePath: string | undefined) {
         this.queue = [];
         this.log = new utils.Log('.gitattributes', process.stderr, verbose);
         this.quiescentCallbacks = [];
+        this.pendingEditsByGAPath = new Map<string, IEdit[]>();
+        // Resolve now, so the cache always goes in the folder the server was
+        // started from.
+        this.basicCachePath = basicCachePath !== undefined ? path.resolve(basicCachePath) : undefined;
+        this.basicCache = new Map<string, IBASICCacheEntry>();
+        this.basicCacheDirty = false;
+        this.basicCacheSaving = false;
+    }
+
+    // Load BASIC cache, if there is one. Call this before scanForBASIC.
+    public async loadBASICCache(): Promise<void> {
+        if (this.basicCachePath === undefined) {
+            return;
+        }
+
+        const data = await utils.tryReadFile(this.basicCachePath);
+        if (data === undefined) {
+            return;
+        }
+
+        try {
+            const cacheFile = JSON.parse(data.toString('utf-8')) as IBASICCacheFile;
+            if (cacheFile.version !== BASIC_CACHE_VERSION) {
+                this.log.pn('Ignoring BASIC cache with version ' + cacheFile.version + ': ' + this.basicCachePath);
+                return;
+            }
+
+            for (const hostPath of Object.keys(cacheFile.entries)) {
+                const entry = cacheFile.entries[hostPath];
+                this.basicCache.set(hostPath, { size: entry[0], mtimeMs: entry[1], basic: entry[2] !== 0 });
+            }
+        } catch (error) {
+            process.stderr.write('WARNING: failed to load BASIC cache: ' + this.basicCachePath + ': ' + error + '\n');
+            this.basicCache.clear();
+        }
+
+        this.log.pn('Loaded BASIC cache: ' + this.basicCache.size + ' entries');
     }
 
     public start(): void {
@@ -60,23 +180,56 @@ export class Manipulator {
     }
 
     public deleteFile(filePath: string): void {
-        // TODO - actually write this.
+        this.edit(filePath, { basename: path.basename(filePath), delete: true });
+
+        if (this.basicCache.delete(filePath)) {
+            this.basicCacheDirty = true;
+        }
     }
 
     public renameFile(oldFilePath: string, newFilePath: string): void {
-        // TODO - actually write this.
-    }
+        // A rename doesn't change the mtime, so the entry stays valid.
+        const entry = this.basicCache.get(oldFilePath);
+        if (entry !== undefined) {
+            this.basicCache.delete(oldFilePath);
+            this.basicCache.set(newFilePath, entry);
+            this.basicCacheDirty = true;
+        }
 
-    public makeFileBASIC(filePath: string, basic: boolean): void {
-        const diff = 'diff=bbcbasic';
+        const oldBasename = path.basename(oldFilePath);
+        const newBasename = path.basename(newFilePath);
 
-        if (basic) {
-            this.change(filePath, undefined, diff);
+        if (path.dirname(oldFilePath) === path.dirname(newFilePath)) {
+            this.edit(oldFilePath, { basename: oldBasename, newBasename });
         } else {
-            this.change(filePath, diff, undefined);
+            // Different .gitattributes file. Move the attributes across once
+            // they've been removed from the old one.
+            this.edit(oldFilePath, {
+                basename: oldBasename,
+                delete: true,
+                deleted: (attrs: string[]): void => {
+                    for (const attr of attrs) {
+                        this.change(newFilePath, undefined, attr);
+                    }
+                },
+            });
         }
     }
 
+    // Call after writing a file, with the BASIC-ness of the data written.
+    public makeFileBASIC(filePath: string, basic: boolean): void {
+        this.setFileBASIC(filePath, basic);
+
+        // Record the new size and mtime, so the next scan won't need to read
+        // the file.
+        this.push(async (): Promise<void> => {
+            const stat = await utils.tryStat(filePath);
+            if (stat !== undefined) {
+                this.setBASICCacheEntry(filePath, stat, basic);
+            }
+        });
+    }
+
     public scanForBASIC(volume: beebfs.Volume): void {
         if (volume.isReadOnly()) {
             return;
@@ -87,161 +240,299 @@ export class Manipulator {
 
             //this.log.pn(path.join(drive.volumePath, drive.name) + ': ' + beebFiles.length + ' Beeb file(s)\n');
 
-            for (const beebFile of beebFiles) {
-                const data = await utils.tryReadFile(beebFile.hostPath);
-                if (data === undefined) {
-                    continue;
+            const isBASICs: (boolean | undefined)[] = [];
+            let nextIdx = 0;
+
+            const scan = async (): Promise<void> => {
+                while (nextIdx < beebFiles.length) {
+                    const idx = nextIdx++;
+                    isBASICs[idx] = await this.isFileBASIC(beebFiles[idx].hostPath);
                 }
+            };
+
+            const scans: Promise<void>[] = [];
+            for (let i = 0; i < SCAN_FOR_BASIC_MAX_PARALLELISM && i < beebFiles.length; ++i) {
+                scans.push(scan());
+            }
 
-                const isBASIC = utils.isBASIC(data);
+            await Promise.all(scans);
 
-                //this.log.pn(beebFile.hostPath + ': is BASIC: ' + (isBASIC ? 'yes' : 'no'));
+            // Make the changes in a consistent order.
+            for (let i = 0; i < beebFiles.length; ++i) {
+                const isBASIC = isBASICs[i];
+                if (isBASIC !== undefined) {
+                    //this.log.pn(beebFiles[i].hostPath + ': is BASIC: ' + (isBASIC ? 'yes' : 'no'));
 
-                this.makeFileBASIC(beebFile.hostPath, isBASIC);
+                    this.setFileBASIC(beebFiles[i].hostPath, isBASIC);
+                }
             }
         });
     }
 
-    private change(filePath: string, remove: string | undefined, add: string | undefined): void {
-        this.push(async (): Promise<void> => {
-            if (this.extraVerbose) {
-                this.log.p('change: filePath=``' + filePath + '\'\': ');
+    private setFileBASIC(filePath: string, basic: boolean): void {
+        const diff = 'diff=bbcbasic';
 
-                if (remove !== undefined) {
-                    this.log.p(' remove ``' + remove + '\'\'');
-                }
+        if (basic) {
+            this.change(filePath, undefined, diff);
+        } else {
+            this.change(filePath, diff, undefined);
+        }
+    }
+
+    // Returns undefined if the file couldn't be read.
+    private async isFileBASIC(filePath: string): Promise<boolean | undefined> {
+        const stat = await utils.tryStat(filePath);
+        if (stat === undefined) {
+            return undefined;
+        }
 
-                if (add !== undefined) {
-                    this.log.p(' add ``' + add + '\'\'');
+        const entry = this.basicCache.get(filePath);
+        if (entry !== undefined) {
+            if (entry.size === stat.size && entry.mtimeMs === stat.mtimeMs) {
+                return entry.basic;
+            }
+        }
+
+        const data = await utils.tryReadFile(filePath);
+        if (data === undefined) {
+            return undefined;
+        }
+
+        const basic = utils.isBASIC(data);
+
+        this.setBASICCacheEntry(filePath, stat, basic);
+
+        return basic;
+    }
+
+    private setBASICCacheEntry(filePath: string, stat: fs.Stats, basic: boolean): void {
+        this.basicCache.set(filePath, { size: stat.size, mtimeMs: stat.mtimeMs, basic });
+        this.basicCacheDirty = true;
+    }
+
+    private saveBASICCache(): void {
+        // If a save is already in progress, it'll pick up any new changes
+        // when it's done.
+        if (this.basicCachePath === undefined || !this.basicCacheDirty || this.basicCacheSaving) {
+            return;
+        }
+
+        void this.saveBASICCacheInternal(this.basicCachePath);
+    }
+
+    private async saveBASICCacheInternal(basicCachePath: string): Promise<void> {
+        this.basicCacheSaving = true;
+        try {
+            while (this.basicCacheDirty) {
+                const cacheFile: IBASICCacheFile = {
+                    version: BASIC_CACHE_VERSION,
+                    entries: {},
+                };
+
+                for (const [hostPath, entry] of this.basicCache) {
+                    cacheFile.entries[hostPath] = [entry.size, entry.mtimeMs, entry.basic ? 1 : 0];
                 }
 
-                this.log.p('\n');
+                this.basicCacheDirty = false;
+
+                // Write then rename, so a crash part way through doesn't
+                // leave a truncated file.
+                const tempPath = `${basicCachePath}.tmp`;
+                try {
+                    await utils.fsWriteFile(tempPath, JSON.stringify(cacheFile));
+                    await utils.fsRename(tempPath, basicCachePath);
+                } catch (error) {
+                    // Try again next time things go quiet.
+                    this.basicCacheDirty = true;
+                    process.stderr.write('WARNING: failed to save BASIC cache: ' + basicCachePath + ': ' + error + '\n');
+                    break;
+                }
             }
+        } finally {
+            this.basicCacheSaving = false;
+        }
+    }
 
-            const gaPath = path.join(path.dirname(filePath), '.gitattributes');
+    private change(filePath: string, remove: string | undefined, add: string | undefined): void {
+        if (this.extraVerbose) {
+            this.log.p('change: filePath=``' + filePath + '\'\': ');
 
-            let basename = path.basename(filePath);
+            if (remove !== undefined) {
+                this.log.p(' remove ``' + remove + '\'\'');
+            }
 
-            if (basename.length === 0) {
-                this.log.pn('(basename.length === 0)');
-                return;
+            if (add !== undefined) {
+                this.log.p(' add ``' + add + '\'\'');
             }
 
-            // https://git-scm.com/docs/gitignore
-            if (basename[0] === '#' || basename[0] === '!') {
-                basename = '\\' + basename;
+            this.log.p('\n');
+        }
+
+        this.edit(filePath, { basename: path.basename(filePath), remove, add });
+    }
+
+    private edit(filePath: string, edit: IEdit): void {
+        if (edit.basename.length === 0) {
+            this.log.pn('(basename.length === 0)');
+            return;
+        }
+
+        const gaPath = path.join(path.dirname(filePath), '.gitattributes');
+
+        const edits = this.pendingEditsByGAPath.get(gaPath);
+        if (edits !== undefined) {
+            // There's already a queue entry that will pick this up.
+            edits.push(edit);
+        } else {
+            this.pendingEditsByGAPath.set(gaPath, [edit]);
+
+            this.push(async (): Promise<void> => {
+                await this.applyEdits(gaPath);
+            });
+        }
+    }
+
+    private async applyEdits(gaPath: string): Promise<void> {
+        const edits = this.pendingEditsByGAPath.get(gaPath);
+        if (edits === undefined) {
+            return;
+        }
+
+        // Anything that comes in from now on goes in a new queue entry.
+        this.pendingEditsByGAPath.delete(gaPath);
+
+        const gaData = await utils.tryReadFile(gaPath);
+        const gaLines = gaData !== undefined ? utils.splitTextFileLines(gaData, 'utf-8') : [];
+
+        let fileChanged = false;
+        for (const edit of edits) {
+            if (this.applyEdit(gaLines, edit)) {
+                fileChanged = true;
             }
+        }
 
-            let gaData = await utils.tryReadFile(gaPath);
-            if (gaData === undefined) {
-                if (add === undefined) {
-                    // it's ok, nothing to do.
-                    this.log.pn('(nothing to do)');
-                    return;
-                }
+        if (!fileChanged) {
+            return;
+        }
 
-                gaData = Buffer.alloc(0);
+        this.log.pn('Updating: ' + gaPath + ' (' + edits.length + ' edit(s))');
+
+        if (gaLines.length === 0) {
+            if (gaData !== undefined) {
+                this.log.pn('Deleting: ' + gaPath);
+                try {
+                    await utils.forceFsUnlink(gaPath);
+                } catch (error) {
+                    this.log.pn('Failed to delete ``' + gaPath + '\'\': ' + error);
+                }
+            }
+        } else {
+            try {
+                const gaNewData = Buffer.from(gaLines.join('\n') + '\n', 'utf-8');
+                await utils.fsWriteFile(gaPath, gaNewData);
+            } catch (error) {
+                this.log.pn('Failed to write to ``' + gaPath + '\'\': ' + error);
             }
+        }
+    }
 
-            const gaLines = utils.splitTextFileLines(gaData, 'utf-8');
+    // Returns true if gaLines was changed.
+    private applyEdit(gaLines: string[], edit: IEdit): boolean {
+        const pattern = getPattern(edit.basename);
 
-            const spacesRE = new RegExp('\\s+');
+        const spacesRE = new RegExp('\\s+');
 
-            let added = false;
-            let removed = false;
-            let fileChanged = false;
+        const deletedAttrs: string[] = [];
 
-            let lineIdx = 0;
+        let added = false;
+        let fileChanged = false;
 
-            while (lineIdx < gaLines.length) {
-                const parts = gaLines[lineIdx].split(spacesRE);
+        let lineIdx = 0;
 
-                let lineChanged = false;
+        while (lineIdx < gaLines.length) {
+            const parts = gaLines[lineIdx].split(spacesRE);
 
-                if (parts.length >= 1) {
-                    if (parts[0] === basename) {
-                        if (remove !== undefined) {
-                            let i = 1;
-                            while (i < parts.length) {
-                                if (parts[i] === remove) {
-                                    parts.splice(i, 1);
-                                    lineChanged = true;
-                                    removed = true;
-                                } else {
-                                    ++i;
-                                }
-                            }
+            let lineChanged = false;
+
+            if (parts.length >= 1) {
+                if (parts[0] === pattern) {
+                    if (edit.delete) {
+                        for (let i = 1; i < parts.length; ++i) {
+                            deletedAttrs.push(parts[i]);
                         }
 
-                        if (add !== undefined) {
-                            let found = false;
-                            for (let i = 1; i < parts.length; ++i) {
-                                if (parts[i] === add) {
-                                    found = true;
-                                    break;
-                                }
-                            }
+                        parts.splice(1);
+                        lineChanged = true;
+                    }
 
-                            if (!found) {
-                                parts.push(add);
+                    if (edit.newBasename !== undefined) {
+                        parts[0] = getPattern(edit.newBasename);
+                        lineChanged = true;
+                    }
+
+                    if (edit.remove !== undefined) {
+                        let i = 1;
+                        while (i < parts.length) {
+                            if (parts[i] === edit.remove) {
+                                parts.splice(i, 1);
                                 lineChanged = true;
+                            } else {
+                                ++i;
+                            }
+                        }
+                    }
+
+                    if (edit.add !== undefined) {
+                        let found = false;
+                        for (let i = 1; i < parts.length; ++i) {
+                            if (parts[i] === edit.add) {
+                                found = true;
+                                break;
                             }
+                        }
 
-                            added = true;
+                        if (!found) {
+                            parts.push(edit.add);
+                            lineChanged = true;
                         }
+
+                        added = true;
                     }
                 }
+            }
 
-                if (lineChanged) {
-                    fileChanged = true;
+            if (lineChanged) {
+                fileChanged = true;
 
-                    if (parts.length === 1) {
-                        // can remove this line now.
-                        gaLines.splice(lineIdx, 1);
-                    } else {
-                        // replace this line.
-                        gaLines[lineIdx] = parts.join(' ');
-                        ++lineIdx;
-                    }
+                if (parts.length === 1) {
+                    // can remove this line now.
+                    gaLines.splice(lineIdx, 1);
                 } else {
+                    // replace this line.
+                    gaLines[lineIdx] = parts.join(' ');
                     ++lineIdx;
                 }
+            } else {
+                ++lineIdx;
             }
+        }
 
-            if (add !== undefined) {
-                if (!added) {
-                    gaLines.push(basename + ' ' + add);
-                    added = true;
-                    fileChanged = true;
-                }
+        if (edit.add !== undefined) {
+            if (!added) {
+                gaLines.push(pattern + ' ' + edit.add);
+                fileChanged = true;
             }
+        }
 
-            if (gaLines.length === 0) {
-                this.log.pn('Deleting: ' + gaPath);
-                try {
-                    await utils.forceFsUnlink(gaPath);
-                } catch (error) {
-                    this.log.pn('Failed to delete ``' + gaPath + '\'\': ' + error);
-                }
-            } else if (fileChanged) {
-                this.log.pn('Updating: ' + gaPath);
-
-                if (remove !== undefined) {
-                    this.log.pn('    (Removing: ' + basename + ' ' + remove + ')');
-                }
+        if (this.extraVerbose && fileChanged) {
+            this.log.pn('    ' + pattern + ': ' + JSON.stringify(edit));
+        }
 
-                if (add !== undefined && added) {
-                    this.log.pn('    (Adding: ' + basename + ' ' + add + ')');
-                }
+        if (edit.deleted !== undefined) {
+            edit.deleted(deletedAttrs);
+        }
 
-                try {
-                    const gaNewData = Buffer.from(gaLines.join('\n'), 'utf-8') + '\n';
-                    await utils.fsWriteFile(gaPath, gaNewData);
-                } catch (error) {
-                    this.log.pn('Failed to write to ``' + gaPath + '\'\': ' + error);
-                }
-            }
-        });
+        return fileChanged;
     }
 
     private push(fun: () => Promise<void>): void {
@@ -265,6 +556,8 @@ export class Manipulator {
                 this.next();
             });
         } else {
+            this.saveBASICCache();
+
             for (const callback of this.quiescentCallbacks) {
                 callback();
             }
@@ -0,0 +1,133 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//
+// BeebLink - BBC Micro file storage system
+//
+// Copyright (C) 2019, 2020 Tom Seddon
+// 
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+//
+//////////////////////////////////////////////////////////////////////////
+
+import * as childProcess from 'child_process';
+import * as os from 'os';
+import * as path from 'path';
+import * as utils from './utils';
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Support for *TOOL, which runs a host program on files from the BBC's
+// volumes. Only programs that have been configured by name, with --tool or
+// the config file, can be run.
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Builds are expected to take seconds on the host. Anything longer probably
+// means the tool is waiting for input that will never come.
+const TIMEOUT_MS = 60 * 1000;
+
+// Only the log comes back over the link, so there's no point keeping
+// megabytes of it.
+const MAX_OUTPUT_SIZE = 16 * 1024;
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+export interface IHostToolResult {
+    // Exit code, or null if the tool was killed.
+    exitCode: number | null;
+
+    timedOut: boolean;
+
+    // Combined stdout and stderr, in the order received. Truncated if very
+    // long.
+    output: Buffer;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Parse a --tool argument, NAME=COMMAND. Names are case-insensitive, as on
+// the BBC, and are stored upper case.
+export function parseToolSpec(spec: string): [string, string] {
+    const index = spec.indexOf('=');
+    if (index <= 0 || index === spec.length - 1) {
+        throw new Error(`invalid tool: ${spec}`);
+    }
+
+    return [spec.slice(0, index).toUpperCase(), spec.slice(index + 1)];
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Whether a free-form argument is OK to pass to a tool. The only host files a
+// tool should get to see are the ones given with <fsp and >fsp, which go
+// through the FS's checks, so anything that could name some other file -
+// path separators, .., a drive letter - is refused. (Tools run in an empty
+// temp folder, so plain relative names go nowhere.)
+export function isSafeArgument(arg: string): boolean {
+    return !/[\/\\]|\.\.|(^|=)[A-Za-z]:/.test(arg);
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Create a temp folder for a tool to run in.
+export async function createTempFolder(): Promise<string> {
+    return await utils.fsMkdtemp(path.join(os.tmpdir(), 'beeblink-tool-'));
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Run the given program, without a shell, so the arguments are passed
+// through verbatim.
+export async function run(command: string, args: string[], cwd: string): Promise<IHostToolResult> {
+    return await new Promise<IHostToolResult>((resolve, reject): void => {
+        const chunks: Buffer[] = [];
+        let outputSize = 0;
+        let timedOut = false;
+
+        const child = childProcess.spawn(command, args, { cwd, stdio: ['ignore', 'pipe', 'pipe'] });
+
+        function handleData(data: Buffer): void {
+            if (outputSize < MAX_OUTPUT_SIZE) {
+                chunks.push(data.slice(0, MAX_OUTPUT_SIZE - outputSize));
+                outputSize += data.length;
+            }
+        }
+
+        child.stdout.on('data', handleData);
+        child.stderr.on('data', handleData);
+
+        const timeout = setTimeout((): void => {
+            timedOut = true;
+            child.kill();
+        }, TIMEOUT_MS);
+
+        child.on('error', (error: Error): void => {
+            clearTimeout(timeout);
+            reject(error);
+        });
+
+        child.on('close', (exitCode: number | null): void => {
+            clearTimeout(timeout);
+            resolve({ exitCode, timedOut, output: Buffer.concat(chunks) });
+        });
+    });
+}
@@ -28,7 +28,7 @@ import * as path from 'path';
 import * as assert from 'assert';
 import * as beeblink from './beeblink';
 import * as beebfs from './beebfs';
-import Server from './server';
+import Server, { IServerCheckpoint } from './server';
 import { Chalk } from 'chalk';
 import chalk from 'chalk';
 import * as gitattributes from './gitattributes';
@@ -37,6 +37,10 @@ import Request from './Request';
 import Response from './Response';
 import * as SerialPort from 'serialport';
 import * as os from 'os';
+import * as serialframing from './serialframing';
+import * as workers from './workers';
+import * as hosttools from './hosttools';
+import * as romcache from './romcache';
 
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
@@ -63,6 +67,14 @@ const DEFAULT_BEEBLINK_UPURS_ROM = './beeblink_upurs_fe60.rom';
 
 const DEFAULT_CONFIG_FILE_NAME = "beeblink_config.json";
 
+// Remembers which files --git found to be BASIC, so they needn't be read again
+// on the next run.
+const BASIC_CACHE_FILE_NAME = 'beeblink_basic_cache.json';
+
+// Per-connection session state, for --session-file.
+const DEFAULT_SESSION_FILE_NAME = 'beeblink_sessions.json';
+const SESSION_CHECKPOINT_INTERVAL_MS = 10 * 1000;
+
 const HTTP_LISTEN_PORT = 48875;//0xbeeb;
 
 const BEEBLINK_SENDER_ID = 'beeblink-sender-id';
@@ -113,6 +125,7 @@ interface IConfigFile {
     git: boolean | undefined;
     serial_include: string[] | undefined;
     serial_exclude: string[] | undefined;
+    tools: { [name: string]: string } | undefined;
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -145,6 +158,12 @@ interface ICommandLineOptions {
     serial_test_pc_to_bbc: boolean;
     serial_test_bbc_to_pc: boolean;
     serial_include: string[] | null;
+    serial_framing_benchmark: number | null;
+    serial_workers: boolean;
+    serial_worker: string | null;
+    session_file: string | null;
+    tool: string[];
+    slow_read_delay: number | null;
 }
 
 //const gLog = new utils.Log('', process.stderr);
@@ -298,6 +317,12 @@ async function loadConfig(options: ICommandLineOptions, filePath: string, mustEx
         }
     }
 
+    const tools = config.tools;
+    if (tools !== undefined) {
+        // Keep config tools first, so the command line takes priority.
+        options.tool.splice(0, 0, ...Object.keys(tools).map((name) => `${name}=${tools[name]}`));
+    }
+
     if (options.avr_rom === null) {
         if (config.avr_rom !== undefined) {
             options.avr_rom = config.avr_rom;
@@ -320,6 +345,23 @@ async function loadConfig(options: ICommandLineOptions, filePath: string, mustEx
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+function getHostToolsConfig(options: ICommandLineOptions): { [name: string]: string } | undefined {
+    if (options.tool.length === 0) {
+        return undefined;
+    }
+
+    const tools: { [name: string]: string } = {};
+    for (const spec of options.tool) {
+        const [name, command] = hosttools.parseToolSpec(spec);
+        tools[name] = command;
+    }
+
+    return tools;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 async function isGit(folderPath: string): Promise<boolean> {
     for (; ;) {
         const gitPath = path.join(folderPath, '.git');
@@ -364,6 +406,16 @@ function getSerialPortPath(portInfo: SerialPort.PortInfo): string {
     return (portInfo as any).path;
 }
 
+// Sessions for USB serial devices are keyed by serial number where possible,
+// so they follow the device if it gets plugged in somewhere else.
+function getSerialPortSessionKey(portInfo: SerialPort.PortInfo): string {
+    if (portInfo.serialNumber !== undefined && portInfo.serialNumber !== '') {
+        return `SERIAL:${portInfo.serialNumber}`;
+    } else {
+        return `SERIAL:${getSerialPortPath(portInfo)}`;
+    }
+}
+
 function shouldOpenSerialDevice(portInfo: SerialPort.PortInfo, options: ICommandLineOptions): IShouldOpenSerialDeviceResult {
     function isSerialPortPathInList(paths: string[] | null): boolean {
         if (paths !== null) {
@@ -533,6 +585,11 @@ async function getSerialPortList(options: ICommandLineOptions): Promise<SerialPo
     const portInfos: SerialPort.PortInfo[] = [];
 
     for (const portInfo of await SerialPort.list()) {
+        if (options.serial_worker !== null && getSerialPortPath(portInfo) !== options.serial_worker) {
+            // Worker processes only handle the one port.
+            continue;
+        }
+
         if (shouldOpenSerialDevice(portInfo, options).shouldOpen) {
             portInfos.push(portInfo);
         }
@@ -715,6 +772,9 @@ async function handleCommandLineOptions(options: ICommandLineOptions, log: utils
     } else if (options.serial_test_bbc_to_pc) {
         void serialTestBBCToPC(options);
         return false;
+    } else if (options.serial_framing_benchmark !== null) {
+        await serialframing.benchmark(options.serial_framing_benchmark, process.stdout);
+        return false;
     }
 
     if (options.load_config === null) {
@@ -750,6 +810,7 @@ async function handleCommandLineOptions(options: ICommandLineOptions, log: utils
             git: options.git,
             serial_include: options.serial_include !== null ? options.serial_include : undefined,
             serial_exclude: options.serial_exclude !== null ? options.serial_exclude : undefined,
+            tools: getHostToolsConfig(options),
         };
 
         await utils.fsMkdirAndWriteFile(options.save_config, JSON.stringify(config, undefined, '  '));
@@ -785,13 +846,24 @@ async function handleCommandLineOptions(options: ICommandLineOptions, log: utils
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
-async function createGitattributesManipulator(options: ICommandLineOptions, volumes: beebfs.Volume[]): Promise<gitattributes.Manipulator | undefined> {
-    if (!options.git) {
+// A --serial-worker process doesn't get one - its updates go via the
+// supervisor, which owns .gitattributes and the BASIC cache.
+async function createGitattributesManipulator(options: ICommandLineOptions): Promise<gitattributes.Manipulator | undefined> {
+    if (!options.git || options.serial_worker !== null) {
         return undefined;
     }
 
-    const gaManipulator = new gitattributes.Manipulator(options.git_verbose);
+    const gaManipulator = new gitattributes.Manipulator(options.git_verbose, BASIC_CACHE_FILE_NAME);
 
+    await gaManipulator.loadBASICCache();
+
+    return gaManipulator;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+function scanGitVolumes(gaManipulator: gitattributes.Manipulator, volumes: beebfs.Volume[]): void {
     // Find all the paths first, then set the gitattributes manipulator
     // going once they've all been collected, in the interests of doing one
     // thing at a time. (Noticeably faster startup on OS X with lots of
@@ -811,23 +883,18 @@ async function createGitattributesManipulator(options: ICommandLineOptions, volu
     gaManipulator.whenQuiescent(() => {
         process.stderr.write('Finished scanning for BASIC files.\n');
     });
-
-    return gaManipulator;
 }
 
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
-function findDefaultVolume(options: ICommandLineOptions, volumes: beebfs.Volume[]): beebfs.Volume | undefined {
+// Only searches until the default volume is found, so the server can get going
+// without waiting for the full volume scan.
+async function findDefaultVolume(options: ICommandLineOptions, log: utils.Log): Promise<beebfs.Volume | undefined> {
     let defaultVolume: beebfs.Volume | undefined;
 
     if (options.default_volume !== null) {
-        for (const volume of volumes) {
-            if (volume.name === options.default_volume) {
-                defaultVolume = volume;
-                break;
-            }
-        }
+        defaultVolume = await beebfs.FS.findVolumeByName(options.default_volume, options.folders, options.pcFolders, log);
 
         if (defaultVolume === undefined) {
             process.stderr.write(`Default volume not found: ${options.default_volume}\n`);
@@ -840,6 +907,26 @@ function findDefaultVolume(options: ICommandLineOptions, volumes: beebfs.Volume[
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Fill in the volume registry in the background. Connections are served in the
+// meantime; volume searches return whatever has been found so far.
+async function findAllVolumes(options: ICommandLineOptions, volumeRegistry: beebfs.VolumeRegistry, gaManipulator: gitattributes.Manipulator | undefined, log: utils.Log): Promise<void> {
+    const volumes = await beebfs.FS.findAllVolumes(options.folders, options.pcFolders, log, (volume: beebfs.Volume): void => {
+        volumeRegistry.add(volume);
+    });
+
+    volumeRegistry.set(volumes);
+    volumeRegistry.setComplete();
+
+    process.stderr.write(`Found ${volumes.length} volume(s).\n`);
+
+    if (gaManipulator !== undefined) {
+        scanGitVolumes(gaManipulator, volumes);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 function getRomPathsForAVR(options: ICommandLineOptions): Map<number, string> {
     const map = new Map<number, string>();
 
@@ -870,7 +957,7 @@ function getRomPathsForSerial(options: ICommandLineOptions): Map<number, string>
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
-function handleHTTP(options: ICommandLineOptions, createServer: (additionalPrefix: string, romPathByLinkSubtype: Map<number, string>) => Promise<Server>): void {
+function handleHTTP(options: ICommandLineOptions, createServer: (additionalPrefix: string, romPathByLinkSubtype: Map<number, string>, sessionKey: string) => Promise<Server>): void {
     if (!options.http) {
         return;
     }
@@ -939,7 +1026,7 @@ function handleHTTP(options: ICommandLineOptions, createServer: (additionalPrefi
             // Find the Server for this sender id.
             let server = serverBySenderId.get(senderId);
             if (server === undefined) {
-                server = await createServer('HTTP', getRomPathsForAVR(options));
+                server = await createServer('HTTP', getRomPathsForAVR(options), `HTTP:${senderId}`);
                 serverBySenderId.set(senderId, server);
             }
 
@@ -949,8 +1036,10 @@ function handleHTTP(options: ICommandLineOptions, createServer: (additionalPrefi
 
             await writeData(Buffer.alloc(1, response.c));
 
-            if (response.p.length > 0) {
-                await writeData(response.p);
+            for (const part of response.parts) {
+                if (part.length > 0) {
+                    await writeData(part);
+                }
             }
 
             await endResponse();
@@ -963,14 +1052,25 @@ function handleHTTP(options: ICommandLineOptions, createServer: (additionalPrefi
                 return await errorResponse(404, undefined);
             }
 
-            const rom = await utils.tryReadFile(options.avr_rom);
-            if (rom === undefined) {
+            let rom: romcache.IROM;
+            try {
+                rom = await romcache.getROM(options.avr_rom);
+            } catch (error) {
                 return await errorResponse(501, undefined);
             }
 
-            httpResponse.setHeader('Content-Type', 'application/binary');
+            // Let clients keep a copy, but have them check it's current.
+            httpResponse.setHeader('ETag', rom.etag);
+            httpResponse.setHeader('Cache-Control', 'no-cache');
 
-            await writeData(rom);
+            const ifNoneMatch = httpRequest.headers['if-none-match'];
+            if (romcache.isIfNoneMatchHit(typeof (ifNoneMatch) === 'string' ? ifNoneMatch : undefined, rom)) {
+                httpResponse.statusCode = 304;
+            } else {
+                httpResponse.setHeader('Content-Type', 'application/binary');
+
+                await writeData(rom.data);
+            }
 
             await endResponse();
         } else {
@@ -1145,11 +1245,6 @@ async function setFTDILatencyTimer(portInfo: SerialPort.PortInfo, ms: number, se
     }
 }
 
-interface IReadWaiter {
-    resolve: (() => void) | undefined;
-    reject: ((error: any) => void) | undefined;
-}
-
 // function getPortDescription(portInfo: SerialPort.PortInfo): string {
 //     return `Device ${getSerialPortPath(portInfo)}`;
 // }
@@ -1185,9 +1280,7 @@ async function handleSerialDevice(options: ICommandLineOptions, portInfo: Serial
         await setFTDILatencyTimer(portInfo, 1, serialLog);
     }
 
-    let readWaiter: IReadWaiter | undefined;
-    const readBuffers: Buffer[] = [];
-    let readIndex = 0;
+    const readQueue = new serialframing.ReadQueue();
 
     const dataInLog = new utils.Log(getSerialPortPath(portInfo), serialLog.f, isSerialDeviceVerbose(portInfo, options.serial_data_verbose));
     const dataOutLog = new utils.Log(getSerialPortPath(portInfo), serialLog.f, isSerialDeviceVerbose(portInfo, options.serial_data_verbose));
@@ -1196,75 +1289,25 @@ async function handleSerialDevice(options: ICommandLineOptions, portInfo: Serial
     process.stderr.write(`${getSerialPortPath(portInfo)}: serving. (verbose=${serialLog.enabled}, data-verbose=(in: ${dataInLog.enabled}, out: ${dataOutLog.enabled}), sync-verbose=${syncLog.enabled})\n`);
 
     port.on('data', (data: Buffer): void => {
-        readBuffers.push(data);
-
         dataInLog.withIndent('data in: ', () => {
             dataInLog.dumpBuffer(data);
         });
 
-        if (readWaiter !== undefined) {
-            const waiter = readWaiter;
-            readWaiter = undefined;
-
-            if (waiter.resolve !== undefined) {
-                waiter.resolve();
-            }
-        }
-
+        readQueue.push(data);
     });
 
-    function rejectReadWaiter(error: any): void {
-        if (readWaiter !== undefined) {
-            const waiter = readWaiter;
-            readWaiter = undefined;
-
-            if (waiter.reject !== undefined) {
-                waiter.reject(error);
-            }
-        }
-    }
-
     port.on('error', (error: any): void => {
         serialLog.pn(`error: ${error}`);
-        rejectReadWaiter(error);
+        readQueue.reject(error);
     });
 
     port.on('close', (error: any): void => {
         serialLog.pn(`close: ${error}`);
-        rejectReadWaiter(error);
+        readQueue.reject(error);
     });
 
     async function readByte(): Promise<number> {
-        if (readBuffers.length === 0) {
-            //dataInLog.pn(`readByte: waiting for more data...`);
-
-            await new Promise<void>((resolve, reject): void => {
-                readWaiter = { resolve, reject };
-            });
-
-            //dataInLog.pn(`readByte: got some data`);
-        }
-
-        //dataInLog.pn(`readByte: readBuffers.length=${readBuffers.length}, readBuffers[0].length=${readBuffers[0].length}, readIndex=0x${readIndex.toString(16)}`);
-        const byte = readBuffers[0][readIndex++];
-
-        if (readIndex === readBuffers[0].length) {
-            readBuffers.splice(0, 1);
-            readIndex = 0;
-        }
-
-        return byte;
-    }
-
-    async function readConfirmationByte(): Promise<boolean> {
-        const byte = await readByte();
-
-        if (byte === 1) {
-            return true;
-        } else {
-            serialLog.pn(`Got confirmation byte: ${byte}  - returning to sync state`);
-            return false;
-        }
+        return await readQueue.readByte();
     }
 
     async function writeSyncData(): Promise<void> {
@@ -1292,13 +1335,6 @@ async function handleSerialDevice(options: ICommandLineOptions, portInfo: Serial
         });
     }
 
-    function getNegativeOffsetLSB(index: number, payload: Buffer): number {
-        assert.ok(index >= 0 && index < payload.length);
-
-        // 
-        return (-(payload.length - 1 - index)) & 0xff;
-    }
-
     async function flush(): Promise<void> {
         await new Promise<void>((resolve, reject) => {
             port.flush((error: any) => {
@@ -1362,18 +1398,10 @@ async function handleSerialDevice(options: ICommandLineOptions, portInfo: Serial
 
                 serialLog.pn(`Got request 0x${utils.hex2(c)}. Waiting for ${p.length} payload bytes...`);
 
-                for (let i = 0; i < p.length; ++i) {
-                    p[i] = await readByte();
-
-                    const j = getNegativeOffsetLSB(i, p);
-
-                    //serialLog.pn(`    index ${i} (-ve LSB=0x${utils.hex2(j)}): value=${p[i]} (0x${utils.hex2(p[i])})`);
-
-                    if (j === 0) {
-                        if (!await readConfirmationByte()) {
-                            break request_response_loop;
-                        }
-                    }
+                const badConfirmationByte = await serialframing.readPayload(readQueue, p);
+                if (badConfirmationByte !== undefined) {
+                    serialLog.pn(`Got confirmation byte: ${badConfirmationByte}  - returning to sync state`);
+                    break request_response_loop;
                 }
 
                 request = new Request(c, p);
@@ -1381,41 +1409,14 @@ async function handleSerialDevice(options: ICommandLineOptions, portInfo: Serial
 
             const response = await server.handleRequest(request);
 
-            let responseData: Buffer;
-
             // serialLog.withIndent('response: ', () => {
             //     serialLog.pn(`c=0x${utils.hex2(response.c)}`);
             //     serialLog.withIndent(`p=`, () => {
-            //         serialLog.dumpBuffer(response.p, 10);
+            //         serialLog.dumpBuffer(response.getPayload(), 10);
             //     });
             // });
 
-            let destIdx = 0;
-
-            if (response.p.length === 1) {
-                responseData = Buffer.alloc(3);
-
-                responseData[destIdx++] = response.c & 0x7f;
-                responseData[destIdx++] = response.p[0];
-                responseData[destIdx++] = 1;//confirmation byte
-            } else {
-                responseData = Buffer.alloc(1 + 4 + response.p.length + ((response.p.length + 255) >> 8));
-
-                responseData[destIdx++] = response.c | 0x80;
-
-                responseData.writeUInt32LE(response.p.length, destIdx);
-                destIdx += 4;
-
-                for (let srcIdx = 0; srcIdx < response.p.length; ++srcIdx) {
-                    responseData[destIdx++] = response.p[srcIdx];
-
-                    if (getNegativeOffsetLSB(srcIdx, response.p) === 0) {
-                        responseData[destIdx++] = 1;//confirmation byte
-                    }
-                }
-            }
-
-            assert.strictEqual(destIdx, responseData.length);
+            const responseData = serialframing.encodeResponse(response);
 
             // This doesn't seem to work terribly well! - should probably just
             // write the whole lot in one big lump and then use the JS analogue
@@ -1443,13 +1444,13 @@ async function handleSerialDevice(options: ICommandLineOptions, portInfo: Serial
                         }
                     }
 
-                    readWaiter = {
+                    readQueue.setWaiter({
                         reject: undefined,
                         resolve: (): void => {
                             serialLog.pn(`Received data while sending - returning to sync state`);
                             callResolveResult(false);
                         },
-                    };
+                    });
 
                     const ok = await new Promise<boolean>((resolve, reject) => {
                         resolveResult = resolve;
@@ -1550,7 +1551,7 @@ interface IPortState {
     active: boolean;
 }
 
-async function handleSerial(options: ICommandLineOptions, createServer: (additionalPrefix: string, romPathByLinkSubtype: Map<number, string>) => Promise<Server>): Promise<void> {
+async function handleSerial(options: ICommandLineOptions, createServer: (additionalPrefix: string, romPathByLinkSubtype: Map<number, string>, sessionKey: string) => Promise<Server>): Promise<void> {
     const log = new utils.Log('SERIAL-DEVICES', process.stdout, options.serial_verbose !== null);
 
     const portStateByPortPath = new Map<string, IPortState>();
@@ -1563,7 +1564,7 @@ async function handleSerial(options: ICommandLineOptions, createServer: (additio
             if (value === undefined) {
                 log.pn(`${portPath}: new serial port`);
                 value = {
-                    server: await createServer('SERIAL', getRomPathsForSerial(options)),
+                    server: await createServer('SERIAL', getRomPathsForSerial(options), getSerialPortSessionKey(portInfo)),
                     active: false,//not quite active just yet!
                 };
                 portStateByPortPath.set(portPath, value);
@@ -1596,19 +1597,198 @@ async function handleSerial(options: ICommandLineOptions, createServer: (additio
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// --serial-workers supervisor: start a worker process for each serial device,
+// and restart it if it dies.
+async function handleSerialWorkers(options: ICommandLineOptions, supervisor: workers.Supervisor): Promise<void> {
+    for (; ;) {
+        for (const portInfo of await getSerialPortList(options)) {
+            supervisor.ensureWorker(getSerialPortPath(portInfo));
+        }
+
+        await delayMS(DEVICE_RETRY_DELAY_MS);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Checkpoints each connection's session state - current volume, dirs, open
+// files and so on - to a file, so that a restarted server can pick up where
+// the previous one left off, without the BBC noticing.
+class SessionCheckpoints {
+    private filePath: string;
+    private log: utils.Log;
+    private checkpointBySessionKey: Map<string, IServerCheckpoint>;
+    private serverBySessionKey: Map<string, Server>;
+    private saving: Promise<void> | undefined;
+
+    // Set when checkpointBySessionKey no longer matches the file.
+    private changed: boolean;
+
+    public constructor(filePath: string, log: utils.Log) {
+        this.filePath = filePath;
+        this.log = log;
+        this.checkpointBySessionKey = new Map<string, IServerCheckpoint>();
+        this.serverBySessionKey = new Map<string, Server>();
+        this.changed = false;
+    }
+
+    public async load(): Promise<void> {
+        const data = await utils.tryReadFile(this.filePath);
+        if (data === undefined) {
+            return;
+        }
+
+        try {
+            const json = JSON.parse(data.toString('utf-8'));
+            for (const sessionKey of Object.keys(json)) {
+                this.checkpointBySessionKey.set(sessionKey, json[sessionKey] as IServerCheckpoint);
+            }
+        } catch (error) {
+            process.stderr.write(`WARNING: failed to load sessions from ${this.filePath}: ${error}\n`);
+        }
+
+        this.log.pn(`Loaded ${this.checkpointBySessionKey.size} session(s) from ${this.filePath}`);
+    }
+
+    // Restore the server's previous state, if there was one.
+    public async addServer(sessionKey: string, server: Server): Promise<void> {
+        this.serverBySessionKey.set(sessionKey, server);
+
+        const checkpoint = this.checkpointBySessionKey.get(sessionKey);
+        if (checkpoint !== undefined) {
+            try {
+                await server.restoreCheckpoint(checkpoint);
+                process.stderr.write(`${sessionKey}: restored previous session.\n`);
+            } catch (error) {
+                process.stderr.write(`${sessionKey}: failed to restore previous session: ${error}\n`);
+                this.checkpointBySessionKey.delete(sessionKey);
+                this.changed = true;
+            }
+        }
+    }
+
+    public async save(): Promise<void> {
+        // Don't let periodic saves and the save on exit overlap.
+        while (this.saving !== undefined) {
+            await this.saving;
+        }
+
+        this.saving = this.saveInternal();
+        try {
+            await this.saving;
+        } finally {
+            this.saving = undefined;
+        }
+    }
+
+    private async saveInternal(): Promise<void> {
+        for (const [sessionKey, server] of this.serverBySessionKey) {
+            try {
+                const checkpoint = server.getCheckpoint();
+                if (checkpoint !== undefined && checkpoint !== this.checkpointBySessionKey.get(sessionKey)) {
+                    this.checkpointBySessionKey.set(sessionKey, checkpoint);
+                    this.changed = true;
+                }
+            } catch (error) {
+                this.log.pn(`${sessionKey}: failed to checkpoint session: ${error}`);
+            }
+        }
+
+        // Servers return the same checkpoint object while they're idle.
+        if (!this.changed) {
+            return;
+        }
+
+        // Sessions from a previous run that haven't reconnected yet are kept.
+        const json: any = {};
+        for (const [sessionKey, checkpoint] of this.checkpointBySessionKey) {
+            json[sessionKey] = checkpoint;
+        }
+
+        // Write then rename, so a crash part way through doesn't leave a
+        // truncated file.
+        const tempPath = `${this.filePath}.tmp`;
+        this.changed = false;
+        try {
+            await utils.fsWriteFile(tempPath, JSON.stringify(json));
+            await utils.fsRename(tempPath, this.filePath);
+        } catch (error) {
+            this.changed = true;
+            process.stderr.write(`WARNING: failed to save sessions to ${this.filePath}: ${error}\n`);
+        }
+    }
+}
+
+async function createSessionCheckpoints(options: ICommandLineOptions, log: utils.Log): Promise<SessionCheckpoints | undefined> {
+    if (options.session_file === null) {
+        return undefined;
+    }
+
+    const sessions = new SessionCheckpoints(options.session_file, log);
+
+    await sessions.load();
+
+    setInterval(() => {
+        void sessions.save();
+    }, SESSION_CHECKPOINT_INTERVAL_MS);
+
+    function saveAndExit(signal: string): void {
+        process.stderr.write(`${signal}: saving sessions...\n`);
+        sessions.save().then(() => {
+            process.exit(0);
+        }).catch(() => {
+            process.exit(1);
+        });
+    }
+
+    process.once('SIGINT', () => saveAndExit('SIGINT'));
+    process.once('SIGTERM', () => saveAndExit('SIGTERM'));
+
+    return sessions;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 async function main(options: ICommandLineOptions) {
     const log = new utils.Log('', process.stderr, options.verbose);
     //gSendLog.enabled = options.send_verbose;
 
+    if (options.serial_worker !== null) {
+        // Serial worker process - the supervisor does everything else.
+        options.http = false;
+        options.save_config = null;
+        if (options.session_file !== null) {
+            options.session_file += '.' + path.basename(options.serial_worker);
+        }
+    }
+
     if (!await handleCommandLineOptions(options, log)) {
         return;
     }
 
-    const volumes = await beebfs.FS.findAllVolumes(options.folders, options.pcFolders, log);
+    const gaManipulator = await createGitattributesManipulator(options);
 
-    const gaManipulator = await createGitattributesManipulator(options, volumes);
+    const defaultVolume = await findDefaultVolume(options, log);
 
-    const defaultVolume = findDefaultVolume(options, volumes);
+    const volumeRegistry = new beebfs.VolumeRegistry(defaultVolume !== undefined ? [defaultVolume] : [], false);
+
+    const sessions = await createSessionCheckpoints(options, log);
+
+    let supervisor: workers.Supervisor | undefined;
+    let sharing: beebfs.IFSSharing | undefined;
+    let fsGAManipulator: gitattributes.IManipulator | undefined = gaManipulator;
+    if (options.serial_worker !== null) {
+        const workerSharing = new workers.WorkerSharing(volumeRegistry);
+        sharing = workerSharing;
+        if (options.git) {
+            fsGAManipulator = workerSharing.getGitattributes();
+        }
+    } else if (options.serial_workers) {
+        supervisor = new workers.Supervisor(process.argv[1], process.argv.slice(2), DEVICE_RETRY_DELAY_MS, volumeRegistry, gaManipulator);
+        sharing = supervisor.getSharing();
+    }
 
     // 
     const logPalette = [
@@ -1619,28 +1799,56 @@ async function main(options: ICommandLineOptions) {
         chalk.black,
     ];
 
+    if (options.slow_read_delay !== null && (options.slow_read_delay < 0 || options.slow_read_delay > 255)) {
+        throw new Error('--slow-read-delay: must be 0-255');
+    }
+
+    const hostToolCommandByName = new Map<string, string>();
+    for (const spec of options.tool) {
+        const [name, command] = hosttools.parseToolSpec(spec);
+        hostToolCommandByName.set(name, command);
+    }
+
     let nextConnectionId = 1;
 
-    async function createServer(additionalPrefix: string, romPathByLinkSubtype: Map<number, string>): Promise<Server> {
+    async function createServer(additionalPrefix: string, romPathByLinkSubtype: Map<number, string>, sessionKey: string): Promise<Server> {
         const connectionId = nextConnectionId++;
         const colours = logPalette[(connectionId - 1) % logPalette.length];//-1 as IDs are 1-based
 
         const bfsLogPrefix = options.fs_verbose ? 'FS' + connectionId : undefined;
         const serverLogPrefix = options.server_verbose ? additionalPrefix + 'SRV' + connectionId : undefined;
 
-        const bfs = new beebfs.FS(bfsLogPrefix, options.folders, options.pcFolders, colours, gaManipulator);
+        const bfs = new beebfs.FS(bfsLogPrefix, options.folders, options.pcFolders, colours, fsGAManipulator, volumeRegistry, sharing);
 
         if (defaultVolume !== undefined) {
             await bfs.mount(defaultVolume);
         }
 
-        const server = new Server(romPathByLinkSubtype, bfs, serverLogPrefix, colours, options.server_data_verbose);
+        const server = new Server(romPathByLinkSubtype, bfs, serverLogPrefix, colours, options.server_data_verbose, hostToolCommandByName, options.slow_read_delay !== null ? options.slow_read_delay : undefined);
+
+        if (sessions !== undefined) {
+            await sessions.addServer(sessionKey, server);
+        }
+
         return server;
     }
 
     handleHTTP(options, createServer);
 
-    void handleSerial(options, createServer);
+    if (supervisor !== undefined) {
+        void handleSerialWorkers(options, supervisor);
+    } else {
+        void handleSerial(options, createServer);
+    }
+
+    // A worker gets the volume list from the supervisor instead.
+    if (options.serial_worker === null) {
+        await findAllVolumes(options, volumeRegistry, gaManipulator, log);
+
+        if (supervisor !== undefined) {
+            supervisor.sendVolumes();
+        }
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -1702,6 +1910,12 @@ function createArgumentParser(fullHelp: boolean): argparse.ArgumentParser {
     always(['--git'], { action: 'storeTrue', help: 'look after .gitattributes for BBC volumes' });
     fullHelpOnly(['--git-verbose'], { action: 'storeTrue', help: 'extra git-related output' });
 
+    // Host tools
+    fullHelpOnly(['--tool'], { action: 'append', defaultValue: [], metavar: 'NAME=COMMAND', help: 'let *TOOL run host program COMMAND as NAME' });
+
+    // BBC settings
+    fullHelpOnly(['--slow-read-delay'], { type: integer, metavar: 'N', help: 'with *BLCONFIG S+, have the BBC wait %(metavar)s*~17 cycles before each byte of a file read (0-255). Default: the ROM\'s setting for its link' });
+
     // Serial devices
     fullHelpOnly(['--serial-include'], { action: 'append', metavar: 'DEVICE', help: 'listen on serial port DEVICE' });
     fullHelpOnly(['--serial-exclude'], { action: 'append', metavar: 'DEVICE', help: 'don\'t listen on serial port DEVICE' });
@@ -1710,8 +1924,14 @@ function createArgumentParser(fullHelp: boolean): argparse.ArgumentParser {
     fullHelpOnly(['--serial-data-verbose'], { action: 'append', nargs: '?', constant: '', help: 'dump raw serial data sent/received (specify devices same as --serial-verbose)' });
     fullHelpOnly(['--serial-test-pc-to-bbc'], { action: 'storeTrue', help: 'run PC->BBC test (goes with T.PC-TO-BBC on the BBC)' });
     fullHelpOnly(['--serial-test-bbc-to-pc'], { action: 'storeTrue', help: 'run BBC->PC test (goes with T.BBC-TO-PC on the BBC)' });
+    fullHelpOnly(['--serial-workers'], { action: 'storeTrue', help: 'serve each serial device from its own process, restarting it if it crashes' });
+    fullHelpOnly(['--serial-worker'], { metavar: 'DEVICE', help: 'internal use: be the worker process for DEVICE' });
+    fullHelpOnly(['--serial-framing-benchmark'], { type: integer, metavar: 'SIZE', help: 'time serial payload framing for a %(metavar)s-byte payload, then exit' });
     always(['--list-serial-devices'], { action: 'storeTrue', help: 'list available serial devices, then exit' });
 
+    // Sessions
+    fullHelpOnly(['--session-file'], { metavar: 'FILE', nargs: '?', constant: DEFAULT_SESSION_FILE_NAME, help: 'periodically save each connection\'s state (volume, dirs, open files) to %(metavar)s (%(constant)s if not specified), and restore it on startup' });
+
     // HTTP server (for b2)
     always(['--http'], { action: 'storeTrue', help: 'enable HTTP server' });
     fullHelpOnly(['--http-all-interfaces'], { action: 'storeTrue', help: 'at own risk, make HTTP server listen on all interfaces, not just localhost' });
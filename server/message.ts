@@ -26,27 +26,25 @@ import * as utils from './utils';
 
 export default class Message {
     public readonly c: number;
-    public readonly p: Buffer;
 
-    protected constructor(c: number, p: Buffer) {
+    protected constructor(c: number) {
         this.c = c;
-        this.p = p;
     }
 
-    protected toStringHelper(cName: string): string {
+    protected toStringHelper(cName: string, p: Buffer): string {
         let s = 'c=' + cName + ' p=[';
 
         let i = 0;
-        while (i < 5 && i < this.p.length) {
+        while (i < 5 && i < p.length) {
             if (i > 0) {
                 s += ' ';
             }
 
-            s += utils.hex2(this.p[i]);
+            s += utils.hex2(p[i]);
             ++i;
         }
 
-        if (i < this.p.length) {
+        if (i < p.length) {
             s += '...';
         }
 
@@ -214,6 +214,10 @@ class PCType implements beebfs.IFSType {
         return new PCState(volume, settings, log);
     }
 
+    public createSettings(json: any): any | undefined {
+        return undefined;
+    }
+
     public canWrite(): boolean {
         return false;
     }
@@ -26,11 +26,15 @@ import Message from './Message';
 import * as utils from './utils';
 
 export default class Request extends Message {
+    public readonly p: Buffer;
+
     public constructor(c: number, p: Buffer) {
-        super(c, p);
+        super(c);
+
+        this.p = p;
     }
 
     public toString(): string {
-        return this.toStringHelper(utils.getRequestTypeName(this.c));
+        return this.toStringHelper(utils.getRequestTypeName(this.c), this.p);
     }
 }
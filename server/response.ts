@@ -26,11 +26,34 @@ import Message from './Message';
 import * as utils from './utils';
 
 export default class Response extends Message {
-    public constructor(c: number, p: Buffer) {
-        super(c, p);
+    // The payload is the concatenation of the parts, so bulk data can be sent
+    // straight from wherever it lives, without building a copy first. The
+    // parts may share storage with other things, so don't modify them.
+    public readonly parts: ReadonlyArray<Buffer>;
+    public readonly length: number;
+
+    public constructor(c: number, p: Buffer | Buffer[]) {
+        super(c);
+
+        this.parts = p instanceof Buffer ? [p] : p;
+
+        this.length = 0;
+        for (const part of this.parts) {
+            this.length += part.length;
+        }
+    }
+
+    // Get the payload as a single Buffer. Copies, if there's more than one
+    // part.
+    public getPayload(): Buffer {
+        if (this.parts.length === 1) {
+            return this.parts[0];
+        } else {
+            return Buffer.concat(this.parts as Buffer[], this.length);
+        }
     }
 
     public toString(): string {
-        return this.toStringHelper(utils.getResponseTypeName(this.c));
+        return this.toStringHelper(utils.getResponseTypeName(this.c), this.getPayload());
     }
 }
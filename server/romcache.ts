@@ -0,0 +1,110 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//
+// BeebLink - BBC Micro file storage system
+//
+// Copyright (C) 2019, 2020 Tom Seddon
+// 
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+//
+//////////////////////////////////////////////////////////////////////////
+
+import * as crypto from 'crypto';
+import * as utils from './utils';
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// ROM images, shared between all connections. Any number of BBCs might ask
+// for the ROM at once (e.g., *SELFUPDATE on a whole room full), so each
+// image is only read once, and then again only if the file changes.
+
+export interface IROM {
+    // Shared by everybody, so don't modify.
+    readonly data: Buffer;
+
+    // Quoted strong entity tag, for HTTP.
+    readonly etag: string;
+}
+
+interface IROMCacheEntry {
+    // Size and modification time, as a string.
+    key: string;
+
+    // Promise, so that simultaneous requests share one load.
+    rom: Promise<IROM>;
+}
+
+const gEntryByPath = new Map<string, IROMCacheEntry>();
+
+async function loadROM(romPath: string): Promise<IROM> {
+    const data = await utils.fsReadFile(romPath);
+
+    return {
+        data,
+        etag: `"${crypto.createHash('sha1').update(data).digest('hex')}"`,
+    };
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// The file is checked each time, with a stat, so a rebuilt ROM is picked up
+// straight away. Throws the Node error if the file can't be read.
+export async function getROM(romPath: string): Promise<IROM> {
+    const stat = await utils.fsStat(romPath);
+    const key = `${stat.size}:${stat.mtimeMs}`;
+
+    let entry = gEntryByPath.get(romPath);
+    if (entry === undefined || entry.key !== key) {
+        entry = { key, rom: loadROM(romPath) };
+        gEntryByPath.set(romPath, entry);
+    }
+
+    try {
+        return await entry.rom;
+    } catch (error) {
+        // Don't hang on to the failure.
+        if (gEntryByPath.get(romPath) === entry) {
+            gEntryByPath.delete(romPath);
+        }
+
+        throw error;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// True if an If-None-Match header value matches the ROM's entity tag.
+export function isIfNoneMatchHit(ifNoneMatch: string | undefined, rom: IROM): boolean {
+    if (ifNoneMatch === undefined) {
+        return false;
+    }
+
+    for (let etag of ifNoneMatch.split(',')) {
+        etag = etag.trim();
+        if (etag.startsWith('W/')) {
+            // Weak comparison is fine for If-None-Match.
+            etag = etag.substr(2);
+        }
+
+        if (etag === '*' || etag === rom.etag) {
+            return true;
+        }
+    }
+
+    return false;
+}
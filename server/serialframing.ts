@@ -0,0 +1,331 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//
+// BeebLink - BBC Micro file storage system
+//
+// Copyright (C) 2019, 2020 Tom Seddon
+// 
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+//
+//////////////////////////////////////////////////////////////////////////
+
+import * as assert from 'assert';
+import Response from './Response';
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Serial link framing.
+//
+// A multi-byte payload is sent with a confirmation byte (always 1) after
+// each byte whose offset from the end of the payload is a multiple of 256. So
+// the payload splits into segments: a first segment of 1-256 bytes, then zero
+// or more 256-byte segments, each followed by its confirmation byte.
+//
+// Everything here works a segment at a time, with Buffer.copy, rather than
+// a byte at a time.
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+export const CONFIRMATION_BYTE = 1;
+
+export const SEGMENT_SIZE = 256;
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+export function getNumConfirmationBytes(payloadSize: number): number {
+    return (payloadSize + SEGMENT_SIZE - 1) >> 8;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Size of the first segment of a payload of the given size. Every subsequent
+// segment is SEGMENT_SIZE bytes.
+export function getFirstSegmentSize(payloadSize: number): number {
+    assert.ok(payloadSize > 0);
+
+    return ((payloadSize - 1) & (SEGMENT_SIZE - 1)) + 1;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Produce the data to send for the given response: command byte, then either
+// 1-byte payload or size and variable-size payload, with confirmation bytes.
+//
+// The response's parts are copied straight in, so this is the only copy of a
+// multi-part payload that's made.
+export function encodeResponse(response: Response): Buffer {
+    const payloadSize = response.length;
+
+    if (payloadSize === 1) {
+        return Buffer.from([response.c & 0x7f, response.getPayload()[0], CONFIRMATION_BYTE]);
+    }
+
+    const data = Buffer.alloc(1 + 4 + payloadSize + getNumConfirmationBytes(payloadSize));
+    let destIdx = 0;
+
+    data[destIdx++] = response.c | 0x80;
+
+    data.writeUInt32LE(payloadSize, destIdx);
+    destIdx += 4;
+
+    if (payloadSize > 0) {
+        // Segments needn't line up with parts.
+        let segmentSizeLeft = getFirstSegmentSize(payloadSize);
+        for (const part of response.parts) {
+            let srcIdx = 0;
+            while (srcIdx < part.length) {
+                const n = Math.min(part.length - srcIdx, segmentSizeLeft);
+
+                part.copy(data, destIdx, srcIdx, srcIdx + n);
+                destIdx += n;
+                srcIdx += n;
+                segmentSizeLeft -= n;
+
+                if (segmentSizeLeft === 0) {
+                    data[destIdx++] = CONFIRMATION_BYTE;
+
+                    segmentSizeLeft = SEGMENT_SIZE;
+                }
+            }
+        }
+    }
+
+    assert.strictEqual(destIdx, data.length);
+
+    return data;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+export interface IReadWaiter {
+    resolve: (() => void) | undefined;
+    reject: ((error: any) => void) | undefined;
+}
+
+// Data received from the serial port, queued up as it arrives, and read out
+// as needed.
+export class ReadQueue {
+    private buffers: Buffer[];
+    private index: number;
+    private waiter: IReadWaiter | undefined;
+
+    public constructor() {
+        this.buffers = [];
+        this.index = 0;
+        this.waiter = undefined;
+    }
+
+    public push(data: Buffer): void {
+        this.buffers.push(data);
+
+        if (this.waiter !== undefined) {
+            const waiter = this.waiter;
+            this.waiter = undefined;
+
+            if (waiter.resolve !== undefined) {
+                waiter.resolve();
+            }
+        }
+    }
+
+    // Fail any read that's waiting for data.
+    public reject(error: any): void {
+        if (this.waiter !== undefined) {
+            const waiter = this.waiter;
+            this.waiter = undefined;
+
+            if (waiter.reject !== undefined) {
+                waiter.reject(error);
+            }
+        }
+    }
+
+    // Set the waiter to be called when data next arrives. (Any read in
+    // progress replaces it.)
+    public setWaiter(waiter: IReadWaiter | undefined): void {
+        this.waiter = waiter;
+    }
+
+    public async readByte(): Promise<number> {
+        await this.waitForData();
+
+        const byte = this.buffers[0][this.index++];
+
+        if (this.index === this.buffers[0].length) {
+            this.buffers.splice(0, 1);
+            this.index = 0;
+        }
+
+        return byte;
+    }
+
+    // Read bytes into dest[begin,end), as many at a time as have arrived.
+    public async readBytes(dest: Buffer, begin: number, end: number): Promise<void> {
+        while (begin < end) {
+            await this.waitForData();
+
+            const src = this.buffers[0];
+            const n = Math.min(end - begin, src.length - this.index);
+
+            src.copy(dest, begin, this.index, this.index + n);
+            begin += n;
+            this.index += n;
+
+            if (this.index === src.length) {
+                this.buffers.splice(0, 1);
+                this.index = 0;
+            }
+        }
+    }
+
+    private async waitForData(): Promise<void> {
+        if (this.buffers.length === 0) {
+            await new Promise<void>((resolve, reject): void => {
+                this.waiter = { resolve, reject };
+            });
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Read a multi-byte payload into p, stripping the confirmation bytes. Returns
+// the offending byte if a confirmation byte is wrong, or undefined if all is
+// well.
+export async function readPayload(queue: ReadQueue, p: Buffer): Promise<number | undefined> {
+    if (p.length > 0) {
+        let i = 0;
+        let segmentSize = getFirstSegmentSize(p.length);
+        while (i < p.length) {
+            await queue.readBytes(p, i, i + segmentSize);
+            i += segmentSize;
+
+            const byte = await queue.readByte();
+            if (byte !== CONFIRMATION_BYTE) {
+                return byte;
+            }
+
+            segmentSize = SEGMENT_SIZE;
+        }
+    }
+
+    return undefined;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Time encodeResponse/readPayload against the old byte-at-a-time code, for
+// --serial-framing-benchmark.
+export async function benchmark(payloadSize: number, f: NodeJS.WritableStream): Promise<void> {
+    // 1-byte payloads have their own format.
+    payloadSize = Math.max(payloadSize, 2);
+
+    const payload = Buffer.alloc(payloadSize);
+    for (let i = 0; i < payload.length; ++i) {
+        payload[i] = i * 7 & 0xff;
+    }
+
+    const response = new Response(0, payload);
+
+    async function time(name: string, fun: () => void | Promise<void>): Promise<void> {
+        const numRuns = 10;
+
+        const startTime = process.hrtime();
+        for (let i = 0; i < numRuns; ++i) {
+            await fun();
+        }
+        const elapsed = process.hrtime(startTime);
+
+        const seconds = elapsed[0] + elapsed[1] / 1e9;
+        const mbPerSecond = payloadSize * numRuns / seconds / (1024 * 1024);
+        f.write(`${name}: ${(seconds / numRuns * 1000).toFixed(2)} ms per ${payloadSize} bytes (${mbPerSecond.toFixed(1)} MBytes/sec)\n`);
+    }
+
+    function getNegativeOffsetLSB(index: number, p: Buffer): number {
+        return (-(p.length - 1 - index)) & 0xff;
+    }
+
+    function encodeBytewise(): Buffer {
+        const data = Buffer.alloc(1 + 4 + payload.length + getNumConfirmationBytes(payload.length));
+        let destIdx = 0;
+        data[destIdx++] = response.c | 0x80;
+        data.writeUInt32LE(payload.length, destIdx);
+        destIdx += 4;
+        for (let srcIdx = 0; srcIdx < payload.length; ++srcIdx) {
+            data[destIdx++] = payload[srcIdx];
+            if (getNegativeOffsetLSB(srcIdx, payload) === 0) {
+                data[destIdx++] = CONFIRMATION_BYTE;
+            }
+        }
+        return data;
+    }
+
+    const encoded = encodeBytewise();
+
+    await time('encode, bytewise', () => {
+        encodeBytewise();
+    });
+
+    await time('encode, segmented', () => {
+        const data = encodeResponse(response);
+        assert.ok(data.equals(encoded));
+    });
+
+    const framed = encoded.slice(1 + 4);
+
+    // Data arrives from the serial port in dribs and drabs.
+    const chunkSize = 64;
+    const chunks: Buffer[] = [];
+    for (let i = 0; i < framed.length; i += chunkSize) {
+        chunks.push(framed.slice(i, i + chunkSize));
+    }
+
+    function createReadQueue(): ReadQueue {
+        const queue = new ReadQueue();
+        for (const chunk of chunks) {
+            queue.push(chunk);
+        }
+
+        return queue;
+    }
+
+    await time('decode, bytewise', async () => {
+        const queue = createReadQueue();
+
+        const p = Buffer.alloc(payloadSize);
+        for (let i = 0; i < p.length; ++i) {
+            p[i] = await queue.readByte();
+            if (getNegativeOffsetLSB(i, p) === 0) {
+                assert.strictEqual(await queue.readByte(), CONFIRMATION_BYTE);
+            }
+        }
+    });
+
+    await time('decode, segmented', async () => {
+        const queue = createReadQueue();
+
+        const p = Buffer.alloc(payloadSize);
+        assert.strictEqual(await readPayload(queue, p), undefined);
+        assert.ok(p.equals(payload));
+    });
+}
@@ -39,21 +39,32 @@ import * as errors from './errors';
 import CommandLine from './CommandLine';
 import * as diskimage from './diskimage';
 import * as ddosimage from './ddosimage';
+import * as virtualdisc from './virtualdisc';
+import * as hosttools from './hosttools';
+import * as inf from './inf';
+import * as romcache from './romcache';
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-function newResponse(c: number, p?: number | Buffer | utils.BufferBuilder) {
-    let data: Buffer;
+// Most responses have a 0- or 1-byte payload. Response data is never
+// modified once created, so these can all be shared.
+const gEmptyBuffer = Buffer.alloc(0);
+const gOneByteBuffers: Buffer[] = [];
+for (let i = 0; i < 256; ++i) {
+    gOneByteBuffers.push(Buffer.alloc(1, i));
+}
+
+function newResponse(c: number, p?: number | Buffer | Buffer[] | utils.BufferBuilder) {
+    let data: Buffer | Buffer[];
     if (typeof (p) === 'number') {
-        data = Buffer.alloc(1);
-        data[0] = p;
-    } else if (p instanceof Buffer) {
+        data = gOneByteBuffers[p & 0xff];
+    } else if (p instanceof Buffer || Array.isArray(p)) {
         data = p;
     } else if (p instanceof utils.BufferBuilder) {
         data = p.createBuffer();
     } else {
-        data = Buffer.alloc(0);
+        data = gEmptyBuffer;
     }
 
     return new Response(c, data);
@@ -67,16 +78,29 @@ class Command {
     public readonly syntax: string | undefined;
 
     public readonly fun: (commandLine: CommandLine) => Promise<Response>;// if this signature changes, change Server.handleStarCommand too.
+    private notInBatch: boolean;
 
     public constructor(name: string, syntax: string | undefined, fun: (commandLine: CommandLine) => Promise<Response>) {
         this.nameUC = name.toUpperCase();
         this.syntax = syntax;
         this.fun = fun;
+        this.notInBatch = false;
     }
 
     public async applyFun(thisObject: any, commandLine: CommandLine): Promise<Response> {
         return await this.fun.apply(thisObject, [commandLine]);
     }
+
+    public isAllowedInBatch(): boolean {
+        return !this.notInBatch;
+    }
+
+    // For commands that need the BBC's involvement, so can't be run from
+    // *BATCH.
+    public withNotInBatch(): Command {
+        this.notInBatch = true;
+        return this;
+    }
 }
 
 /////////////////////////////////////////////////////////////////////////
@@ -140,6 +164,21 @@ interface IDiskImageDetails {
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// A >fsp argument to *TOOL.
+interface IHostToolOutput {
+    file: beebfs.File;
+
+    // Temp file the tool writes to.
+    hostPath: string;
+
+    // From the command line, if specified.
+    load: number | undefined;
+    exec: number | undefined;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 function getIOAddress(addr: number): number {
     return 0xffff0000 + (addr & 0xffff);
 }
@@ -154,6 +193,68 @@ function encodeForOSCLI(command: string): Buffer {
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Boot sequences and menus tend to ask the same few questions over and over.
+// Requests that only read the FS state get their responses remembered, and
+// replayed until some other request comes along that might change things, or
+// the server writes to the disk on behalf of any connection, in any server
+// process (see beebfs.getWriteGeneration).
+//
+// Changes made on the host side aren't noticed, so memos also expire after a
+// short time.
+const RESPONSE_MEMO_LIFETIME_MS = 2000;
+const MAX_NUM_RESPONSE_MEMOS = 64;
+
+interface IResponseMemo {
+    response: Response;
+
+    // Text to be read by subsequent READ_STRING requests, if a text response.
+    text: Buffer | undefined;
+
+    // beebfs.getWriteGeneration() from before the request was handled.
+    writeGeneration: number;
+
+    expiryTime: number;
+}
+
+function isMemoizableRequest(request: Request): boolean {
+    switch (request.c) {
+        case beeblink.REQUEST_BOOT_OPTION:
+        case beeblink.REQUEST_STAR_INFO:
+        case beeblink.REQUEST_STAR_EX:
+            return true;
+
+        case beeblink.REQUEST_OSFILE:
+            // A=5 - read catalogue info
+            return request.p.length > 0 && request.p[0] === 5;
+
+        case beeblink.REQUEST_OSGBPB:
+            // A=5/6/7 - read title, current dir, library dir
+            return request.p.length > 0 && request.p[0] >= 5 && request.p[0] <= 7;
+
+        default:
+            return false;
+    }
+}
+
+// Requests that don't affect the FS state, and don't invalidate memos.
+function isNeutralRequest(request: Request): boolean {
+    return request.c === beeblink.REQUEST_READ_STRING || request.c === beeblink.REQUEST_READ_STRING_VERBOSE;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Plain JSON snapshot of a Server's session state - see getCheckpoint.
+export interface IServerCheckpoint {
+    linkSubtype: number | null;
+    stringBuffer: string | null;//base64
+    stringBufferIdx: number;
+    fs: beebfs.IFSCheckpoint;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 // This handles the front-end duties of decomposing payloads, parsing command
 // lines, routing requests to the appropriate methods of BeebFS, and dealing
 // with the packet writing. Try to isolate the lower levels from the packet
@@ -164,6 +265,9 @@ export default class Server {
     private linkSubtype: number | undefined;
     private romPathByLinkSubtype: Map<number, string>;
     private stringBuffer: Buffer | undefined;
+    // Error to produce once the string has been read, so that output printed
+    // before an error isn't lost.
+    private stringBufferError: errors.BeebError | undefined;
     private stringBufferIdx: number;
     private commands: Command[];
     private handlers: (Handler | undefined)[];
@@ -172,15 +276,37 @@ export default class Server {
     private speedTest: speedtest.SpeedTest | undefined;
     private dumpPackets: boolean;
     private diskImageFlow: diskimage.Flow | undefined;
-
-    public constructor(romPathByLinkSubtype: Map<number, string>, bfs: beebfs.FS, logPrefix: string | undefined, colours: Chalk | undefined, dumpPackets: boolean) {
+    private virtualDrives: virtualdisc.Drives;
+    private printFQN: beebfs.FQN | undefined;
+    private numRequestsInProgress: number;
+    private inBatch: boolean;
+    private lastCheckpoint: IServerCheckpoint | undefined;
+
+    // Number of requests started, and the same as of lastCheckpoint, so an
+    // idle connection's checkpoint can be reused as-is.
+    private numRequests: number;
+    private lastCheckpointNumRequests: number;
+    private hostToolCommandByName: Map<string, string>;
+    private responseMemoByKey: Map<string, IResponseMemo>;
+    private slowReadDelay: number | undefined;
+
+    public constructor(romPathByLinkSubtype: Map<number, string>, bfs: beebfs.FS, logPrefix: string | undefined, colours: Chalk | undefined, dumpPackets: boolean, hostToolCommandByName: Map<string, string>, slowReadDelay: number | undefined) {
         this.romPathByLinkSubtype = romPathByLinkSubtype;
+        this.hostToolCommandByName = hostToolCommandByName;
+        this.slowReadDelay = slowReadDelay;
         this.linkSubtype = undefined;
         this.bfs = bfs;
         this.stringBufferIdx = 0;
+        this.numRequestsInProgress = 0;
+        this.numRequests = 0;
+        this.lastCheckpointNumRequests = 0;
+        this.inBatch = false;
+        this.responseMemoByKey = new Map<string, IResponseMemo>();
 
         this.commands = [
             new Command('ACCESS', '<afsp> (<mode>)', this.accessCommand),
+            new Command('BATCH', '<fsp>', this.batchCommand).withNotInBatch(),
+            new Command('BLPRINT', '(<fsp>)', this.blprintCommand).withNotInBatch(),
             new Command('DEFAULTS', '([SRP])', this.defaultsCommand),
             new Command('DELETE', '<fsp>', this.deleteCommand),
             new Command('DIR', '(<dir>)', this.dirCommand),
@@ -193,18 +319,20 @@ export default class Server {
             new Command('LIST', '<fsp>', this.listCommand),
             new Command('LOCATE', '<afsp>', this.locateCommand),
             new Command('NEWVOL', '<vsp>', this.newvolCommand),
-            new Command('READ', '<fsp> <drive> <type>', this.readCommand),
+            new Command('READ', '<fsp> <drive> <type>', this.readCommand).withNotInBatch(),
             new Command('RENAME', '<old fsp> <new fsp>', this.renameCommand),
-            new Command('SELFUPDATE', undefined, this.selfupdateCommand),
-            new Command('SRLOAD', '<fsp> <addr> <bank> (Q)', this.srloadCommand),
-            new Command('SPEEDTEST', undefined, this.speedtestCommand),
+            new Command('SELFUPDATE', undefined, this.selfupdateCommand).withNotInBatch(),
+            new Command('SRLOAD', '<fsp> <addr> <bank> (Q)', this.srloadCommand).withNotInBatch(),
+            new Command('SPEEDTEST', undefined, this.speedtestCommand).withNotInBatch(),
             new Command('TITLE', '<title>', this.titleCommand),
+            new Command('TOOL', '<name> (<args>)', this.toolCommand),
             new Command('TYPE', '<fsp>', this.typeCommand),
-            new Command('VOLBROWSER', undefined, this.volbrowserCommand),
+            new Command('VDRIVE', '(<drive> (<fsp> <type>))', this.vdriveCommand),
+            new Command('VOLBROWSER', undefined, this.volbrowserCommand).withNotInBatch(),
             new Command('VOL', '(<avsp>) (R)', this.volCommand),
             new Command('VOLS', '(<avsp>)', this.volsCommand),
             new Command('WDUMP', '<fsp>', this.wdumpCommand),
-            new Command('WRITE', '<fsp> <drive> <type>', this.writeCommand),
+            new Command('WRITE', '<fsp> <drive> <type>', this.writeCommand).withNotInBatch(),
         ];
 
         this.handlers = [];
@@ -237,33 +365,140 @@ export default class Server {
         this.handlers[beeblink.REQUEST_NEXT_DISK_IMAGE_PART] = new Handler('NEXT_DISK_IMAGE_part', this.handleNextDiskImagePart);
         this.handlers[beeblink.REQUEST_SET_LAST_DISK_IMAGE_OSWORD_RESULT] = new Handler('SET_LAST_DISK_IMAGE_OSWORD_RESULT', this.handleSetLastDiskImageOSWORDResult);
         this.handlers[beeblink.REQUEST_FINISH_DISK_IMAGE_FLOW] = new Handler('FINISH_DISK_IMAGE_FLOW', this.handleFinishDiskImageFlow);
+        this.handlers[beeblink.REQUEST_DISC_OSWORD] = new Handler('DISC_OSWORD', this.handleDiscOSWORD);
+        this.handlers[beeblink.REQUEST_PRINT] = new Handler('PRINT', this.handlePrint);
+        this.handlers[beeblink.REQUEST_GET_SLOW_READ_DELAY] = new Handler('GET_SLOW_READ_DELAY', this.handleGetSlowReadDelay);
 
         this.log = new utils.Log(logPrefix !== undefined ? logPrefix : '', process.stderr, logPrefix !== undefined);
         this.log.colours = colours;
         this.dumpPackets = dumpPackets;
+        this.virtualDrives = new virtualdisc.Drives(this.bfs, this.log);
     }
 
     public async handleRequest(request: Request): Promise<Response> {
         this.dumpPacket(request);
 
-        const response = await this.handleRequestInternal(request);
+        let response: Response | undefined;
+        ++this.numRequestsInProgress;
+        ++this.numRequests;
+        try {
+            if (isMemoizableRequest(request)) {
+                response = this.getMemoizedResponse(request);
+                if (response === undefined) {
+                    const writeGeneration = beebfs.getWriteGeneration();
+                    response = await this.handleRequestInternal(request);
+                    this.memoizeResponse(request, response, writeGeneration);
+                }
+            } else {
+                if (!isNeutralRequest(request)) {
+                    this.responseMemoByKey.clear();
+                }
+
+                response = await this.handleRequestInternal(request);
+            }
+        } finally {
+            --this.numRequestsInProgress;
+        }
 
         this.dumpPacket(response);
 
         return response;
     }
 
+    // Get snapshot of session state, for restoring on restart.
+    //
+    // Checkpoints are only taken between requests, so if there's one in
+    // progress, the previous checkpoint is returned instead. So is the
+    // previous checkpoint if there have been no requests since, so callers
+    // can tell nothing's changed. Nothing is written to disk. (*VDRIVE and
+    // *BLPRINT state isn't included.)
+    public getCheckpoint(): IServerCheckpoint | undefined {
+        if (this.numRequestsInProgress === 0 && (this.lastCheckpoint === undefined || this.numRequests !== this.lastCheckpointNumRequests)) {
+            this.lastCheckpointNumRequests = this.numRequests;
+            this.lastCheckpoint = {
+                linkSubtype: this.linkSubtype !== undefined ? this.linkSubtype : null,
+                stringBuffer: this.stringBuffer !== undefined ? this.stringBuffer.toString('base64') : null,
+                stringBufferIdx: this.stringBufferIdx,
+                fs: this.bfs.getCheckpoint(),
+            };
+        }
+
+        return this.lastCheckpoint;
+    }
+
+    public async restoreCheckpoint(checkpoint: IServerCheckpoint): Promise<void> {
+        await this.bfs.restoreCheckpoint(checkpoint.fs);
+
+        this.linkSubtype = checkpoint.linkSubtype !== null ? checkpoint.linkSubtype : undefined;
+        this.stringBuffer = checkpoint.stringBuffer !== null ? Buffer.from(checkpoint.stringBuffer, 'base64') : undefined;
+        this.stringBufferIdx = checkpoint.stringBufferIdx;
+        this.stringBufferError = undefined;
+
+        this.lastCheckpoint = checkpoint;
+        this.lastCheckpointNumRequests = this.numRequests;
+
+        this.responseMemoByKey.clear();
+    }
+
+    private getResponseMemoKey(request: Request): string {
+        return String.fromCharCode(request.c) + request.p.toString('binary');
+    }
+
+    private getMemoizedResponse(request: Request): Response | undefined {
+        const key = this.getResponseMemoKey(request);
+
+        const memo = this.responseMemoByKey.get(key);
+        if (memo === undefined) {
+            return undefined;
+        }
+
+        if (memo.writeGeneration !== beebfs.getWriteGeneration() || Date.now() >= memo.expiryTime) {
+            this.responseMemoByKey.delete(key);
+            return undefined;
+        }
+
+        this.log.pn(`${utils.getRequestTypeName(request.c)}: memoized response`);
+
+        if (memo.text !== undefined) {
+            this.stringBuffer = memo.text;
+            this.stringBufferIdx = 0;
+            this.stringBufferError = undefined;
+        }
+
+        return memo.response;
+    }
+
+    private memoizeResponse(request: Request, response: Response, writeGeneration: number): void {
+        if (response.c === beeblink.RESPONSE_ERROR) {
+            return;
+        }
+
+        if (this.responseMemoByKey.size >= MAX_NUM_RESPONSE_MEMOS) {
+            this.responseMemoByKey.clear();
+        }
+
+        this.responseMemoByKey.set(this.getResponseMemoKey(request), {
+            response,
+            text: response.c === beeblink.RESPONSE_TEXT ? this.stringBuffer : undefined,
+            writeGeneration,
+            expiryTime: Date.now() + RESPONSE_MEMO_LIFETIME_MS,
+        });
+    }
+
     private dumpPacket(packet: Request | Response): void {
         if (this.dumpPackets) {
             let desc: string | undefined;
             let typeName: string;
+            let p: Buffer;
 
             if (packet instanceof Request) {
                 desc = utils.getRequestTypeName(packet.c);
                 typeName = 'Request';
+                p = packet.p;
             } else {
                 desc = utils.getResponseTypeName(packet.c);
                 typeName = 'Response';
+                p = packet.getPayload();
             }
 
             this.log.withIndent(`${typeName}: `, () => {
@@ -273,7 +508,7 @@ export default class Server {
                 }
                 this.log.pn('');
 
-                this.log.dumpBuffer(packet.p, 10);
+                this.log.dumpBuffer(p, 10);
             });
         }
     }
@@ -331,9 +566,9 @@ export default class Server {
                 return errors.generic('No ROM for link subtype');
             } else {
                 try {
-                    const rom = await utils.fsReadFile(romPath);
-                    this.log.pn('ROM is ' + rom.length + ' bytes');
-                    return newResponse(beeblink.RESPONSE_DATA, rom);
+                    const rom = await romcache.getROM(romPath);
+                    this.log.pn('ROM is ' + rom.data.length + ' bytes');
+                    return newResponse(beeblink.RESPONSE_DATA, rom.data);
                 } catch (error) {
                     return errors.nodeError(error);
                 }
@@ -372,6 +607,15 @@ export default class Server {
         return newResponse(beeblink.RESPONSE_YES, 0);
     }
 
+    private async handleGetSlowReadDelay(handler: Handler, p: Buffer): Promise<Response> {
+        if (this.slowReadDelay === undefined) {
+            return newResponse(beeblink.RESPONSE_NO, 0);
+        } else {
+            this.log.pn('slow read delay=' + this.slowReadDelay);
+            return newResponse(beeblink.RESPONSE_DATA, this.slowReadDelay);
+        }
+    }
+
     private async handleEchoData(handler: Handler, p: Buffer): Promise<Response> {
         this.log.pn('Sending ' + p.length + ' byte(s) back...');
         return newResponse(beeblink.RESPONSE_DATA, p);
@@ -384,6 +628,13 @@ export default class Server {
             this.log.pn('string not present.');
             return newResponse(beeblink.RESPONSE_NO, 0);
         } else if (this.stringBufferIdx >= this.stringBuffer.length) {
+            if (this.stringBufferError !== undefined) {
+                const error = this.stringBufferError;
+                this.stringBufferError = undefined;
+                this.log.pn('string exhausted; producing error: ' + error);
+                throw error;
+            }
+
             this.log.pn('string exhausted.');
             return newResponse(beeblink.RESPONSE_NO, 0);
         } else {
@@ -422,6 +673,17 @@ export default class Server {
             return errors.badCommand();
         }
 
+        const matchedCommand = this.findCommand(commandLine);
+        if (matchedCommand !== undefined) {
+            return await this.runCommand(matchedCommand, commandLine);
+        } else {
+            return await this.handleRun(commandLine, true);//true = check library directory
+        }
+    }
+
+    // Find command matching the command line, allowing for abbreviations. The
+    // command line parts may be adjusted to split off the command name.
+    private findCommand(commandLine: CommandLine): Command | undefined {
         let matchedCommand: Command | undefined;
 
         const part0UC = commandLine.parts[0].toUpperCase();
@@ -474,21 +736,21 @@ export default class Server {
             this.log.pn(`    ${i}. "${commandLine.parts[i]}"`);
         }
 
-        if (matchedCommand !== undefined) {
-            try {
-                return await matchedCommand.applyFun(this, commandLine);
-            } catch (error) {
-                if (error instanceof errors.BeebError) {
-                    if (error.code === 220 && error.text === '') {
-                        const text = 'Syntax: ' + matchedCommand.nameUC + (matchedCommand.syntax !== undefined ? ' ' + matchedCommand.syntax : '');
-                        return errors.syntax(text);
-                    }
-                }
+        return matchedCommand;
+    }
 
-                throw error;
+    private async runCommand(command: Command, commandLine: CommandLine): Promise<Response> {
+        try {
+            return await command.applyFun(this, commandLine);
+        } catch (error) {
+            if (error instanceof errors.BeebError) {
+                if (error.code === 220 && error.text === '') {
+                    const text = 'Syntax: ' + command.nameUC + (command.syntax !== undefined ? ' ' + command.syntax : '');
+                    return errors.syntax(text);
+                }
             }
-        } else {
-            return await this.handleRun(commandLine, true);//true = check library directory
+
+            throw error;
         }
     }
 
@@ -710,18 +972,21 @@ export default class Server {
         const newPtr = p.readUInt32LE(i);
         i += 4;
 
-        const data = Buffer.alloc(p.length - i);
-        p.copy(data, 0, i);
+        // The payload isn't used once the request has been handled, so
+        // there's no need to copy the data.
+        const data = p.slice(i);
         i += p.length;
 
         this.log.pn('Input: A=0x' + utils.hex2(a) + ', handle=' + utils.hexdec(handle) + ', addr=0x' + utils.hex8(addr) + ', size=' + utils.hexdec(numBytes) + ', PTR#=' + utils.hexdec(newPtr) + ', ' + data.length + ' data bytes');
 
         const result = await this.bfs.OSGBPB(a, handle, numBytes, newPtr, data);
 
+        const resultDataLength = result.getDataLength();
+
         this.log.withIndent('Output: ', () => {
             this.log.p('Output: C=' + result.c + ', addr=0x' + utils.hex8(addr) + ', bytes left=' + result.numBytesLeft + ', PTR#=' + result.ptr);
             if (result.data !== undefined) {
-                this.log.p(', ' + result.data.length + ' data bytes');
+                this.log.p(', ' + resultDataLength + ' data bytes');
             }
             this.log.p('\n');
 
@@ -729,7 +994,7 @@ export default class Server {
                 // Probably not actually all that interesting.
             } else {
                 if (result.data !== undefined) {
-                    this.log.dumpBuffer(result.data);
+                    this.log.dumpBuffer(Buffer.concat(result.data));
                 }
             }
         });
@@ -745,17 +1010,18 @@ export default class Server {
         // This is a bit weird, but only one of input data and output data will
         // be set. (Also: the address could be updated on the 6502 end, but why
         // not do it here.)
-        builder.writeUInt32LE(addr + data.length + (result.data !== undefined ? result.data.length : 0));
+        builder.writeUInt32LE(addr + data.length + resultDataLength);
 
         builder.writeUInt32LE(result.numBytesLeft !== undefined ? result.numBytesLeft : numBytes);
 
         builder.writeUInt32LE(result.ptr !== undefined ? result.ptr : newPtr);
 
-        if (result.data !== undefined) {
-            builder.writeBuffer(result.data);
+        if (result.data === undefined) {
+            return newResponse(beeblink.RESPONSE_OSGBPB, builder);
+        } else {
+            // Send the data as-is, after the header.
+            return newResponse(beeblink.RESPONSE_OSGBPB, [builder.createBuffer()].concat(result.data));
         }
-
-        return newResponse(beeblink.RESPONSE_OSGBPB, builder);
     }
 
     private async handleOPT(handler: Handler, p: Buffer): Promise<Response> {
@@ -832,19 +1098,21 @@ export default class Server {
             const height = p[3];
             const m128 = p[4] >= 3;
 
-            const volumePaths = await this.bfs.findAllVolumesMatching('*');
-
-            this.volumeBrowser = new volumebrowser.Browser(charSizeBytes, width, height, m128, volumePaths);
+            this.volumeBrowser = new volumebrowser.Browser(charSizeBytes, width, height, m128, this.bfs.getVolumeRegistry());
 
             const text = this.volumeBrowser.getInitialString();
 
             //this.log.pn('Browser initial string: ' + this.getBASICStringExpr(text));
 
-            return this.textResponse(text);
+            this.textResponse(text);
+
+            return this.volumeBrowserResponse(this.volumeBrowser, beeblink.RESPONSE_VOLUME_BROWSER_PRINT_STRING_AND_FLUSH_KEYBOARD_BUFFER);
         } else if (p[0] === beeblink.REQUEST_VOLUME_BROWSER_KEYPRESS && this.volumeBrowser !== undefined) {
             this.log.pn('REQUEST_VOLUME_BROWSER_KEYPRESS');
 
-            this.payloadMustBe(handler, p, 3);
+            this.payloadMustBe(handler, p, 4);
+
+            this.volumeBrowser.setLocalCursorRow(p[3]);
 
             const result = this.volumeBrowser.handleKey(p[2], p[1] !== 0);
 
@@ -878,18 +1146,27 @@ export default class Server {
                 this.textResponse(result.text);
 
                 if (result.flushKeyboardBuffer) {
-                    return newResponse(beeblink.RESPONSE_VOLUME_BROWSER, beeblink.RESPONSE_VOLUME_BROWSER_PRINT_STRING_AND_FLUSH_KEYBOARD_BUFFER);
+                    return this.volumeBrowserResponse(this.volumeBrowser, beeblink.RESPONSE_VOLUME_BROWSER_PRINT_STRING_AND_FLUSH_KEYBOARD_BUFFER);
                 } else {
-                    return newResponse(beeblink.RESPONSE_VOLUME_BROWSER, beeblink.RESPONSE_VOLUME_BROWSER_PRINT_STRING);
+                    return this.volumeBrowserResponse(this.volumeBrowser, beeblink.RESPONSE_VOLUME_BROWSER_PRINT_STRING);
                 }
             } else {
-                return newResponse(beeblink.RESPONSE_VOLUME_BROWSER, beeblink.RESPONSE_VOLUME_BROWSER_KEY_IGNORED);
+                return this.volumeBrowserResponse(this.volumeBrowser, beeblink.RESPONSE_VOLUME_BROWSER_KEY_IGNORED);
             }
         } else {
             return this.internalError('Bad ' + handler.name + ' request');
         }
     }
 
+    private volumeBrowserResponse(volumeBrowser: volumebrowser.Browser, responseType: number): Response {
+        const builder = new utils.BufferBuilder();
+
+        builder.writeUInt8(responseType);
+        builder.writeBuffer(volumeBrowser.getLocalCursor());
+
+        return newResponse(beeblink.RESPONSE_VOLUME_BROWSER, builder);
+    }
+
     private async handleSpeedTest(handler: Handler, p: Buffer): Promise<Response> {
         this.payloadMustBeAtLeast(handler, p, 1);
 
@@ -1114,6 +1391,40 @@ export default class Server {
         return newResponse(beeblink.RESPONSE_DATA, Buffer.concat(buffers));
     }
 
+    private async handleDiscOSWORD(handler: Handler, p: Buffer): Promise<Response> {
+        this.payloadMustBeAtLeast(handler, p, 1 + virtualdisc.BLOCK_SIZE);
+
+        const reason = p[0];
+        const block = Buffer.from(p.slice(1, 1 + virtualdisc.BLOCK_SIZE));
+        const data = p.slice(1 + virtualdisc.BLOCK_SIZE);
+
+        const result = this.virtualDrives.OSWORD(reason, block, data);
+        if (result === undefined) {
+            return newResponse(beeblink.RESPONSE_NO, 0);
+        }
+
+        const builder = new utils.BufferBuilder();
+
+        builder.writeBuffer(result.block);
+
+        if (result.data !== undefined) {
+            builder.writeBuffer(result.data);
+        }
+
+        return newResponse(beeblink.RESPONSE_DISC_OSWORD, builder);
+    }
+
+    private async handlePrint(handler: Handler, p: Buffer): Promise<Response> {
+        if (this.printFQN === undefined) {
+            // Shouldn't happen, but the data has nowhere to go.
+            this.log.pn(`No print file - discarding ${p.length} bytes`);
+        } else {
+            await this.bfs.appendToFile(this.printFQN, p);
+        }
+
+        return newResponse(beeblink.RESPONSE_YES, 0);
+    }
+
     private internalError(text: string): never {
         return errors.generic(text);
     }
@@ -1177,6 +1488,7 @@ export default class Server {
 
         this.stringBuffer = value;
         this.stringBufferIdx = 0;
+        this.stringBufferError = undefined;
 
         // ...args: (number | string)[]) {
         // this.setString(...args);
@@ -1251,6 +1563,10 @@ export default class Server {
         }
         text += BNL;
 
+        if (!this.bfs.getVolumeRegistry().isComplete()) {
+            text += '(Still searching - list may be incomplete)' + BNL;
+        }
+
         return this.textResponse(text);
     }
 
@@ -1290,6 +1606,92 @@ export default class Server {
         return newResponse(beeblink.RESPONSE_YES, 0);
     }
 
+    // Run each line of a text file as a command, entirely on the server, and
+    // return all the output in one go. Stops at the first error.
+    private async batchCommand(commandLine: CommandLine): Promise<Response> {
+        if (commandLine.parts.length !== 2) {
+            return errors.syntax();
+        }
+
+        if (this.inBatch) {
+            return errors.wont('Nested BATCH');
+        }
+
+        const lines = await this.bfs.readTextFile(await this.bfs.getExistingBeebFileForRead(await this.bfs.parseFQN(commandLine.parts[1])));
+
+        let text = '';
+
+        this.inBatch = true;
+        try {
+            for (let lineIdx = 0; lineIdx < lines.length; ++lineIdx) {
+                // Same as the MOS: skip leading spaces and *s, and | is a
+                // comment.
+                const line = lines[lineIdx].replace(/^[ *]*/, '');
+                if (line === '' || line[0] === '|') {
+                    continue;
+                }
+
+                this.log.pn(`BATCH: line ${lineIdx + 1}: ${line}`);
+
+                try {
+                    text += await this.runBatchLine(line);
+                } catch (error) {
+                    if (error instanceof errors.BeebError) {
+                        const lineError = new errors.BeebError(error.code, `${error.text} at line ${lineIdx + 1}`);
+                        if (text === '') {
+                            throw lineError;
+                        }
+
+                        // Print the earlier lines' output, then the error.
+                        const response = this.textResponse(text);
+                        this.stringBufferError = lineError;
+                        return response;
+                    }
+
+                    throw error;
+                }
+            }
+        } finally {
+            this.inBatch = false;
+        }
+
+        if (text === '') {
+            return newResponse(beeblink.RESPONSE_YES, 0);
+        }
+
+        return this.textResponse(text);
+    }
+
+    // Run one *BATCH line, returning its output. Errors don't include the line
+    // number - the caller adds that.
+    private async runBatchLine(line: string): Promise<string> {
+        const commandLine = this.initCommandLine(line);
+        if (commandLine.parts.length === 0) {
+            return '';
+        }
+
+        const command = this.findCommand(commandLine);
+        if (command === undefined) {
+            return errors.badCommand();
+        }
+
+        // Check before running it, so there are no side effects left behind.
+        if (!command.isAllowedInBatch()) {
+            return errors.wont('Not in BATCH');
+        }
+
+        const response = await this.runCommand(command, commandLine);
+        if (response.c === beeblink.RESPONSE_TEXT) {
+            return this.stringBuffer !== undefined ? this.stringBuffer.toString('binary') : '';
+        } else if (response.c !== beeblink.RESPONSE_YES) {
+            // Needs the BBC's involvement, so should have been marked
+            // withNotInBatch.
+            return errors.wont('Not in BATCH');
+        } else {
+            return '';
+        }
+    }
+
     private async deleteCommand(commandLine: CommandLine): Promise<Response> {
         if (commandLine.parts.length < 2) {
             return errors.syntax();
@@ -1476,7 +1878,7 @@ export default class Server {
             return errors.wont();
         }
 
-        const builder = new utils.BufferBuilder();
+        const builder = new utils.BufferBuilder(4 + rom.length);
 
         builder.writeUInt8(beeblink.RESPONSE_SPECIAL_SRLOAD);
         builder.writeUInt8(bank);
@@ -1511,6 +1913,204 @@ export default class Server {
         return newResponse(beeblink.RESPONSE_YES, 0);
     }
 
+    // Addresses come from, in order of preference: the command line; a .inf
+    // file written by the tool; the existing file; the first input file.
+    private async getHostToolOutputAddresses(output: IHostToolOutput, firstInputFile: beebfs.File | undefined): Promise<[number, number]> {
+        if (output.load !== undefined && output.exec !== undefined) {
+            return [output.load, output.exec];
+        }
+
+        const infBuffer = await utils.tryReadFile(output.hostPath + inf.ext);
+        if (infBuffer !== undefined) {
+            const outputINF = await inf.tryParse(infBuffer, output.hostPath, path.basename(output.hostPath), undefined);
+            if (outputINF !== undefined && !outputINF.noINF) {
+                return [outputINF.load, outputINF.exec];
+            }
+        }
+
+        if (await utils.fsExists(output.file.hostPath)) {
+            return [output.file.load, output.file.exec];
+        }
+
+        if (firstInputFile !== undefined) {
+            return [firstInputFile.load, firstInputFile.exec];
+        }
+
+        return [output.file.load, output.file.exec];
+    }
+
+    // Run a configured host program. <fsp arguments are replaced with the
+    // host path of that file, and >fsp arguments with the path of a temp
+    // file that's saved to that name afterwards. Other arguments are passed
+    // through as-is, provided they don't look like host paths.
+    private async toolCommand(commandLine: CommandLine): Promise<Response> {
+        if (commandLine.parts.length < 2) {
+            return errors.syntax();
+        }
+
+        const command = this.hostToolCommandByName.get(commandLine.parts[1].toUpperCase());
+        if (command === undefined) {
+            return errors.generic('Unknown tool');
+        }
+
+        const folderPath = await hosttools.createTempFolder();
+        try {
+            const args: string[] = [];
+            const outputs: IHostToolOutput[] = [];
+            let firstInputFile: beebfs.File | undefined;
+            for (const part of commandLine.parts.slice(2)) {
+                if (part.startsWith('<')) {
+                    const file = await this.bfs.getExistingBeebFileForRead(await this.bfs.parseFQN(part.slice(1)));
+
+                    // The tool reads the file on disk, so it mustn't have
+                    // unwritten changes.
+                    this.bfs.mustNotBeOpenForWrite(file);
+
+                    if (firstInputFile === undefined) {
+                        firstInputFile = file;
+                    }
+
+                    args.push(file.hostPath);
+                } else if (part.startsWith('>')) {
+                    // >fsp, >fsp:load or >fsp:load:exec.
+                    let fsp = part.slice(1);
+                    let load: number | undefined;
+                    let exec: number | undefined;
+                    const match = /^(.+?):([0-9A-Fa-f]{1,8})(?::([0-9A-Fa-f]{1,8}))?$/.exec(fsp);
+                    if (match !== null) {
+                        fsp = match[1];
+                        load = Number.parseInt(match[2], 16);
+                        exec = match[3] !== undefined ? Number.parseInt(match[3], 16) : load;
+                    }
+
+                    // Check the output can be written before running
+                    // anything.
+                    const file = await this.bfs.getBeebFileForWrite(await this.bfs.parseFQN(fsp));
+                    const hostPath = path.join(folderPath, `output${outputs.length}`);
+                    outputs.push({ file, hostPath, load, exec });
+                    args.push(hostPath);
+                } else {
+                    if (!hosttools.isSafeArgument(part)) {
+                        return errors.generic(`Bad tool argument: ${part}`);
+                    }
+
+                    args.push(part);
+                }
+            }
+
+            this.log.pn(`TOOL: ${command} ${args.join(' ')}`);
+
+            let result: hosttools.IHostToolResult;
+            try {
+                result = await hosttools.run(command, args, folderPath);
+            } catch (error) {
+                return errors.generic(`Can't run tool: ${(error as NodeJS.ErrnoException).code}`);
+            }
+
+            let text = utils.splitTextFileLines(result.output, 'binary').join(BNL);
+            if (text !== '') {
+                text += BNL;
+            }
+
+            if (result.timedOut || result.exitCode !== 0) {
+                const reason = result.timedOut ? 'timed out' : `exit code ${result.exitCode}`;
+                this.log.pn(`TOOL: failed: ${reason}`);
+
+                if (this.inBatch) {
+                    return errors.generic(`Tool failed: ${reason}`);
+                }
+
+                return this.textResponse(`${text}Tool failed: ${reason}${BNL}`);
+            }
+
+            for (const output of outputs) {
+                const data = await utils.tryReadFile(output.hostPath);
+                if (data === undefined) {
+                    text += `Not written: ${output.file.fqn}${BNL}`;
+                    continue;
+                }
+
+                const [load, exec] = await this.getHostToolOutputAddresses(output, firstInputFile);
+
+                await this.bfs.saveFile(output.file.fqn, load, exec, data);
+
+                text += `Saved: ${output.file.fqn} ${utils.hex8(load).toUpperCase()} ${utils.hex8(exec).toUpperCase()} ${utils.hex8(data.length).toUpperCase()}${BNL}`;
+            }
+
+            if (text === '') {
+                return newResponse(beeblink.RESPONSE_YES, 0);
+            }
+
+            return this.textResponse(text);
+        } finally {
+            try {
+                await utils.fsRemoveFolder(folderPath);
+            } catch (error) {
+                this.log.pn(`TOOL: failed to remove ${folderPath}: ${error}`);
+            }
+        }
+    }
+
+    private async blprintCommand(commandLine: CommandLine): Promise<Response> {
+        if (commandLine.parts.length < 2) {
+            // Stop. Leave the print file set - the ROM will send whatever
+            // is still in the printer buffer after this.
+            return newResponse(beeblink.RESPONSE_SPECIAL, Buffer.from([beeblink.RESPONSE_SPECIAL_PRINTER, 0]));
+        }
+
+        const fqn = await this.bfs.parseFQN(commandLine.parts[1]);
+
+        // Check it's writeable, and create it if necessary.
+        await this.bfs.appendToFile(fqn, Buffer.alloc(0));
+
+        this.printFQN = fqn;
+
+        return newResponse(beeblink.RESPONSE_SPECIAL, Buffer.from([beeblink.RESPONSE_SPECIAL_PRINTER, 1]));
+    }
+
+    private async vdriveCommand(commandLine: CommandLine): Promise<Response> {
+        if (commandLine.parts.length >= 2) {
+            const driveStr = commandLine.parts[1];
+            if (driveStr.length !== 1 || !utils.isdigit(driveStr)) {
+                return errors.syntax();
+            }
+
+            const drive = +driveStr;
+
+            if (commandLine.parts.length === 2) {
+                // Detach whatever's attached, DFS or ADFS.
+                await this.virtualDrives.detach(false, drive);
+                await this.virtualDrives.detach(true, drive);
+            } else if (commandLine.parts.length === 4) {
+                let type: virtualdisc.ImageType;
+                switch (commandLine.parts[3].toLowerCase()) {
+                    case 's':
+                        type = virtualdisc.ImageType.SSD;
+                        break;
+
+                    case 'd':
+                        type = virtualdisc.ImageType.DSD;
+                        break;
+
+                    case 'a':
+                        type = virtualdisc.ImageType.ADFS;
+                        break;
+
+                    default:
+                        return errors.syntax();
+                }
+
+                const file = await this.bfs.getExistingBeebFileForRead(await this.bfs.parseFQN(commandLine.parts[2]));
+
+                await this.virtualDrives.attach(drive, file, type);
+            } else {
+                return errors.syntax();
+            }
+        }
+
+        return this.textResponse(this.virtualDrives.getDrivesString());
+    }
+
     private async volbrowserCommand(commandLine: CommandLine): Promise<Response> {
         return newResponse(beeblink.RESPONSE_SPECIAL, beeblink.RESPONSE_SPECIAL_VOLUME_BROWSER);
     }
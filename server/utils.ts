@@ -45,11 +45,16 @@ export const fsUnlink = util.promisify(fs.unlink);
 export const fsTruncate = util.promisify(fs.truncate);
 export const fsOpen = util.promisify(fs.open);
 export const fsClose = util.promisify(fs.close);
+export const fsFtruncate = util.promisify(fs.ftruncate);
+export const fsWrite = util.promisify(fs.write);
 export const fsRead = util.promisify(fs.read);
 export const fsRename = util.promisify(fs.rename);
 export const fsMkdir = util.promisify(fs.mkdir);
 export const fsExists = util.promisify(fs.exists);
 export const fsWriteFile = util.promisify(fs.writeFile);
+export const fsAppendFile = util.promisify(fs.appendFile);
+export const fsMkdtemp = util.promisify(fs.mkdtemp);
+export const fsRmdir = util.promisify(fs.rmdir);
 
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
@@ -67,6 +72,78 @@ export async function fsMkdirAndWriteFile(name: string, data: any): Promise<void
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+export interface ISparseFileExtent {
+    offset: number;
+    data: Buffer;
+}
+
+// Like fsMkdirAndWriteFile, but the file is sized using truncate, and only the
+// given extents are written. Everything else reads back as zeros, and (on
+// filesystems that support it) takes up no space.
+export async function fsMkdirAndWriteSparseFile(name: string, size: number, extents: ISparseFileExtent[]): Promise<void> {
+    try {
+        await fsMkdir(path.dirname(name), { recursive: true });
+    } catch (error) {
+        // just ignore... if it's a problem, fsOpen will throw.
+    }
+
+    const fd = await fsOpen(name, 'w');
+    try {
+        await fsFtruncate(fd, size);
+
+        for (const extent of extents) {
+            // Writes can be short, so keep going until it's all written.
+            let i = 0;
+            while (i < extent.data.length) {
+                const result = await fsWrite(fd, extent.data, i, extent.data.length - i, extent.offset + i);
+                if (result.bytesWritten <= 0) {
+                    throw new Error(`Failed to write: ${name}`);
+                }
+
+                i += result.bytesWritten;
+            }
+        }
+    } finally {
+        await fsClose(fd);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// fs.readdir with withFileTypes, so the entry types come for free.
+export async function fsReaddirWithFileTypes(folderPath: string): Promise<fs.Dirent[]> {
+    return await new Promise<fs.Dirent[]>((resolve, reject) => {
+        fs.readdir(folderPath, { withFileTypes: true }, (error, entries) => {
+            if (error !== null && error !== undefined) {
+                reject(error);
+            } else {
+                resolve(entries);
+            }
+        });
+    });
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Delete a folder and everything in it.
+export async function fsRemoveFolder(folderPath: string): Promise<void> {
+    for (const dirent of await fsReaddirWithFileTypes(folderPath)) {
+        const entryPath = path.join(folderPath, dirent.name);
+        if (dirent.isDirectory()) {
+            await fsRemoveFolder(entryPath);
+        } else {
+            await fsUnlink(entryPath);
+        }
+    }
+
+    await fsRmdir(folderPath);
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 export async function forceFsUnlink(filePath: string) {
     try {
         await fsUnlink(filePath);
@@ -85,62 +162,78 @@ export async function forceFsUnlink(filePath: string) {
 /////////////////////////////////////////////////////////////////////////
 
 // The Buffer API is rather annoying.
+//
+// Data is accumulated in a Buffer that doubles in size as required, so
+// building a response doesn't generate a JS number per byte.
 export class BufferBuilder {
-    private bytes: number[] = [];
+    private static readonly INITIAL_CAPACITY = 256;
+
+    private buffer: Buffer;
+    private length = 0;
+
+    public constructor(capacity?: number) {
+        this.buffer = Buffer.alloc(Math.max(capacity !== undefined ? capacity : 0, BufferBuilder.INITIAL_CAPACITY));
+    }
 
     public getLength() {
-        return this.bytes.length;
+        return this.length;
     }
 
     public writeUInt8(...values: number[]): number {
-        const offset = this.bytes.length;
+        const offset = this.length;
 
-        for (const value of values) {
-            this.bytes.push(value);
+        this.ensureCapacity(offset + values.length);
+
+        for (let i = 0; i < values.length; ++i) {
+            this.buffer[offset + i] = values[i];
         }
 
+        this.length += values.length;
+
         return offset;
     }
 
     public setUInt8(value: number, offset: number): void {
-        this.bytes[offset] = value;
+        this.buffer[offset] = value;
     }
 
     public setUInt16LE(value: number, offset: number): void {
-        this.bytes[offset + 0] = (value >> 0) & 0xff;
-        this.bytes[offset + 1] = (value >> 8) & 0xff;
+        this.buffer[offset + 0] = (value >> 0) & 0xff;
+        this.buffer[offset + 1] = (value >> 8) & 0xff;
     }
 
     public writeUInt16LE(value: number): number {
-        const offset = this.bytes.length;
+        const offset = this.length;
 
-        this.writeUInt8((value >> 0) & 0xff, (value >> 8) & 0xff);
+        this.ensureCapacity(offset + 2);
+        this.setUInt16LE(value, offset);
+        this.length += 2;
 
         return offset;
     }
 
     public setUInt32LE(value: number, offset: number): void {
-        this.bytes[offset + 0] = (value >> 0) & 0xff;
-        this.bytes[offset + 1] = (value >> 8) & 0xff;
-        this.bytes[offset + 2] = (value >> 16) & 0xff;
-        this.bytes[offset + 3] = (value >> 24) & 0xff;
+        this.buffer[offset + 0] = (value >> 0) & 0xff;
+        this.buffer[offset + 1] = (value >> 8) & 0xff;
+        this.buffer[offset + 2] = (value >> 16) & 0xff;
+        this.buffer[offset + 3] = (value >> 24) & 0xff;
     }
 
     public writeUInt32LE(value: number): number {
-        const offset = this.bytes.length;
+        const offset = this.length;
 
-        this.writeUInt8((value >> 0) & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff);
+        this.ensureCapacity(offset + 4);
+        this.setUInt32LE(value, offset);
+        this.length += 4;
 
         return offset;
     }
 
     public writeBuffer(bytes: Buffer | BufferBuilder) {
         if (bytes instanceof Buffer) {
-            for (const byte of bytes) {
-                this.writeUInt8(byte);
-            }
+            this.copyFrom(bytes, 0, bytes.length);
         } else if (bytes instanceof BufferBuilder) {
-            this.bytes = this.bytes.concat(bytes.bytes);
+            this.copyFrom(bytes.buffer, 0, bytes.length);
         }
     }
 
@@ -158,13 +251,33 @@ export class BufferBuilder {
         }
 
         this.writeUInt8(length);
-        for (let i = 0; i < length; ++i) {
-            this.writeUInt8(buffer[i]);
-        }
+        this.copyFrom(buffer, 0, length);
     }
 
+    // The result shares memory with the builder, so the builder shouldn't be
+    // modified afterwards. (Appending is fine; setXXX isn't.)
     public createBuffer(): Buffer {
-        return Buffer.from(this.bytes);
+        return this.buffer.slice(0, this.length);
+    }
+
+    private copyFrom(src: Buffer, begin: number, end: number): void {
+        this.ensureCapacity(this.length + (end - begin));
+        this.length += src.copy(this.buffer, this.length, begin, end);
+    }
+
+    private ensureCapacity(capacity: number): void {
+        if (capacity <= this.buffer.length) {
+            return;
+        }
+
+        let newCapacity = this.buffer.length * 2;
+        while (newCapacity < capacity) {
+            newCapacity *= 2;
+        }
+
+        const newBuffer = Buffer.alloc(newCapacity);
+        this.buffer.copy(newBuffer, 0, 0, this.length);
+        this.buffer = newBuffer;
     }
 }
 
@@ -611,6 +724,39 @@ export function splitTextFileLines(b: Buffer, encoding: string): string[] {
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Equivalent to splitTextFileLines, then joining the lines back together with
+// each one terminated by CR, but in one pass with no intermediate strings.
+export function getTextFileWithCRLineEndings(b: Buffer): Buffer {
+    // The result is never longer than the input, except that a CR might need
+    // adding to the last line.
+    const result = Buffer.alloc(b.length + 1);
+    let resultIdx = 0;
+
+    let j = 0;
+    while (j < b.length) {
+        const c = b[j++];
+
+        if (c === 10 || c === 13) {
+            result[resultIdx++] = 13;
+
+            if (j < b.length && (b[j] === 10 || b[j] === 13) && b[j] !== c) {
+                ++j;
+            }
+        } else {
+            result[resultIdx++] = c;
+        }
+    }
+
+    if (resultIdx > 0 && result[resultIdx - 1] !== 13) {
+        result[resultIdx++] = 13;
+    }
+
+    return result.slice(0, resultIdx);
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
 export function isBASIC(b: Buffer): boolean {
     let i = 0;
 
@@ -0,0 +1,475 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//
+// BeebLink - BBC Micro file storage system
+//
+// Copyright (C) 2020 Tom Seddon
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+//
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+import * as utils from './utils';
+import * as beebfs from './beebfs';
+import * as errors from './errors';
+import * as adfsimage from './adfsimage';
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const SECTOR_SIZE_BYTES = 256;
+const DFS_TRACK_SIZE_SECTORS = 10;
+const DFS_MAX_NUM_TRACKS = 80;
+const DFS_NUM_DRIVES = 4;
+const ADFS_NUM_DRIVES = 8;
+
+// Size of the parameter block sent by the ROM. Enough for OSWORD &72 and
+// OSWORD &7F with up to 8 parameters.
+export const BLOCK_SIZE = 16;
+
+// Written images are held in memory and written back once there's been no
+// further writes for this long.
+const WRITE_BACK_DELAY_MS = 2000;
+
+// 8271 commands.
+const DFS_WRITE_DATA = 0x4b;
+const DFS_WRITE_DELETED_DATA = 0x4f;
+const DFS_READ_DATA = 0x53;
+const DFS_READ_DATA_AND_DELETED_DATA = 0x57;
+const DFS_READ_ID = 0x5b;
+const DFS_VERIFY = 0x5f;
+const DFS_SEEK = 0x69;
+
+// 8271 results.
+const DFS_RESULT_OK = 0x00;
+const DFS_RESULT_WRITE_PROTECTED = 0x12;
+const DFS_RESULT_SECTOR_NOT_FOUND = 0x18;
+
+// OSWORD &72 commands.
+const ADFS_READ = 0x08;
+const ADFS_WRITE = 0x0a;
+
+// OSWORD &72 results - SCSI-style sense codes.
+const ADFS_RESULT_OK = 0x00;
+const ADFS_RESULT_BAD_ADDRESS = 0x21;
+const ADFS_RESULT_WRITE_PROTECTED = 0x27;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+export enum ImageType {
+    SSD,
+    DSD,
+    ADFS,
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The result of a disc OSWORD: the updated parameter block, and the data read,
+// if any.
+export interface IOSWORDResult {
+    block: Buffer;
+    data: Buffer | undefined;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The ROM sends the data for a write along with the parameter block, sized
+// from the block. Don't write whatever's there if the two disagree.
+function mustHaveWriteData(data: Buffer, size: number): void {
+    if (data.length !== size) {
+        return errors.generic(`Bad disc OSWORD write data (${data.length} bytes; expected ${size})`);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+class Image {
+    public readonly file: beebfs.File;
+    public readonly type: ImageType;
+    public readonly writeProtected: boolean;
+    public data: Buffer;
+    public dirty: boolean;
+
+    public constructor(file: beebfs.File, type: ImageType, data: Buffer) {
+        this.file = file;
+        this.type = type;
+        this.writeProtected = file.fqn.volume.isReadOnly() || (file.attr & beebfs.L_ATTR) !== 0;
+        this.data = data;
+        this.dirty = false;
+    }
+
+    public read(offset: number, size: number): Buffer {
+        // Anything past the end of the file reads as zeros - SSDs are usually
+        // truncated after the last used sector.
+        const data = Buffer.alloc(size);
+        if (offset < this.data.length) {
+            this.data.copy(data, 0, offset, Math.min(offset + size, this.data.length));
+        }
+
+        return data;
+    }
+
+    public write(offset: number, data: Buffer): void {
+        if (offset + data.length > this.data.length) {
+            const newData = Buffer.alloc(offset + data.length);
+            this.data.copy(newData);
+            this.data = newData;
+        }
+
+        data.copy(this.data, offset);
+        this.dirty = true;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+interface IDFSDrive {
+    image: Image;
+    side: number;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Disc images attached to DFS and ADFS drive numbers, serving the disc OSWORDs
+// the ROM forwards.
+//
+// Each OSWORD is handled as a single transfer, however many sectors it covers.
+// Writes go to the in-memory copy of the image, which is written back to the
+// file after a short delay, when the image is detached, or when flush is
+// called. Write-back goes through the connection's FS, so it's subject to the
+// same checks and locking as any other save.
+export class Drives {
+    private bfs: beebfs.FS;
+    private dfsDrives: (IDFSDrive | undefined)[];
+    private adfsDrives: (Image | undefined)[];
+    private log: utils.Log;
+    private writeBackTimeout: NodeJS.Timer | undefined;
+
+    public constructor(bfs: beebfs.FS, log: utils.Log) {
+        this.bfs = bfs;
+        this.dfsDrives = [];
+        this.adfsDrives = [];
+        this.log = log;
+        this.writeBackTimeout = undefined;
+    }
+
+    public async attach(drive: number, file: beebfs.File, type: ImageType): Promise<void> {
+        if (type === ImageType.ADFS) {
+            if (drive < 0 || drive >= ADFS_NUM_DRIVES) {
+                return errors.badDrive();
+            }
+        } else if (type === ImageType.DSD) {
+            // the second side is drive+2.
+            if (drive !== 0 && drive !== 1) {
+                return errors.badDrive();
+            }
+        } else {
+            if (drive < 0 || drive >= DFS_NUM_DRIVES) {
+                return errors.badDrive();
+            }
+        }
+
+        await this.detach(type === ImageType.ADFS, drive);
+        if (type === ImageType.DSD) {
+            await this.detach(false, drive + 2);
+        }
+
+        const image = new Image(file, type, await beebfs.FS.readFile(file));
+
+        if (type === ImageType.ADFS) {
+            this.adfsDrives[drive] = image;
+        } else {
+            this.dfsDrives[drive] = { image, side: 0 };
+            if (type === ImageType.DSD) {
+                this.dfsDrives[drive + 2] = { image, side: 1 };
+            }
+        }
+    }
+
+    // If the write-back fails, the image stays attached.
+    public async detach(adfs: boolean, drive: number): Promise<void> {
+        if (adfs) {
+            const image = this.adfsDrives[drive];
+            if (image !== undefined) {
+                await this.writeBack(image);
+            }
+
+            this.adfsDrives[drive] = undefined;
+        } else {
+            const dfsDrive = this.dfsDrives[drive];
+            if (dfsDrive !== undefined) {
+                const image = dfsDrive.image;
+
+                await this.writeBack(image);
+
+                // detach both sides of a DSD.
+                for (let i = 0; i < this.dfsDrives.length; ++i) {
+                    if (this.dfsDrives[i] !== undefined && this.dfsDrives[i]!.image === image) {
+                        this.dfsDrives[i] = undefined;
+                    }
+                }
+            }
+        }
+    }
+
+    public getDrivesString(): string {
+        let text = '';
+
+        for (let drive = 0; drive < DFS_NUM_DRIVES; ++drive) {
+            const dfsDrive = this.dfsDrives[drive];
+            if (dfsDrive !== undefined) {
+                text += `DFS ${drive}: ${dfsDrive.image.file.fqn}${dfsDrive.image.type === ImageType.DSD ? ` (side ${dfsDrive.side})` : ''}${dfsDrive.image.writeProtected ? ' (R)' : ''}${utils.BNL}`;
+            }
+        }
+
+        for (let drive = 0; drive < ADFS_NUM_DRIVES; ++drive) {
+            const image = this.adfsDrives[drive];
+            if (image !== undefined) {
+                text += `ADFS ${drive}: ${image.file.fqn}${image.writeProtected ? ' (R)' : ''}${utils.BNL}`;
+            }
+        }
+
+        if (text.length === 0) {
+            text = `No disc images attached${utils.BNL}`;
+        }
+
+        return text;
+    }
+
+    // Returns undefined if this OSWORD isn't for an attached drive, or isn't
+    // supported, and should be passed on to the real DFS/ADFS.
+    public OSWORD(reason: number, block: Buffer, data: Buffer): IOSWORDResult | undefined {
+        if (reason === 0x7f) {
+            return this.dfsOSWORD(block, data);
+        } else if (reason === 0x72) {
+            return this.adfsOSWORD(block, data);
+        } else {
+            return undefined;
+        }
+    }
+
+    public async flush(): Promise<void> {
+        const images = new Set<Image>();
+
+        for (const dfsDrive of this.dfsDrives) {
+            if (dfsDrive !== undefined) {
+                images.add(dfsDrive.image);
+            }
+        }
+
+        for (const image of this.adfsDrives) {
+            if (image !== undefined) {
+                images.add(image);
+            }
+        }
+
+        for (const image of images) {
+            await this.writeBack(image);
+        }
+    }
+
+    private dfsOSWORD(block: Buffer, data: Buffer): IOSWORDResult | undefined {
+        const drive = block[0];
+
+        // Top bit set means the current drive, which only the DFS knows.
+        if (drive >= DFS_NUM_DRIVES) {
+            return undefined;
+        }
+
+        const dfsDrive = this.dfsDrives[drive];
+        if (dfsDrive === undefined) {
+            return undefined;
+        }
+
+        const numParams = block[5];
+        const resultOffset = 7 + numParams;
+        if (resultOffset >= block.length) {
+            return undefined;
+        }
+
+        const command = block[6];
+        const track = block[7];
+        const sector = block[8];
+        const sectorSizeCode = block[9] >> 5;
+        const numSectors = block[9] & 31;
+
+        let result = DFS_RESULT_OK;
+        let readData: Buffer | undefined;
+
+        switch (command) {
+            case DFS_READ_DATA:
+            case DFS_READ_DATA_AND_DELETED_DATA:
+            case DFS_WRITE_DATA:
+            case DFS_WRITE_DELETED_DATA:
+                {
+                    const write = command === DFS_WRITE_DATA || command === DFS_WRITE_DELETED_DATA;
+
+                    this.log.pn(`DFS ${write ? 'write' : 'read'}: drive=${drive} track=${track} sector=${sector} count=${numSectors}`);
+
+                    if (sectorSizeCode !== 1 || sector + numSectors > DFS_TRACK_SIZE_SECTORS || track >= this.getNumDFSTracks(dfsDrive)) {
+                        result = DFS_RESULT_SECTOR_NOT_FOUND;
+                    } else if (write && dfsDrive.image.writeProtected) {
+                        result = DFS_RESULT_WRITE_PROTECTED;
+                    } else {
+                        const numSides = dfsDrive.image.type === ImageType.DSD ? 2 : 1;
+                        const offset = ((track * numSides + dfsDrive.side) * DFS_TRACK_SIZE_SECTORS + sector) * SECTOR_SIZE_BYTES;
+                        const size = numSectors * SECTOR_SIZE_BYTES;
+
+                        if (write) {
+                            mustHaveWriteData(data, size);
+                            this.writeImage(dfsDrive.image, offset, data.slice(0, size));
+                        } else {
+                            readData = dfsDrive.image.read(offset, size);
+                        }
+                    }
+                }
+                break;
+
+            case DFS_READ_ID:
+                // Sector IDs for a standard 10-sector track.
+                readData = Buffer.alloc(numSectors * 4);
+                for (let i = 0; i < numSectors; ++i) {
+                    readData[i * 4 + 0] = track;
+                    readData[i * 4 + 1] = 0;
+                    readData[i * 4 + 2] = i % DFS_TRACK_SIZE_SECTORS;
+                    readData[i * 4 + 3] = 1;
+                }
+                break;
+
+            case DFS_SEEK:
+            case DFS_VERIFY:
+                break;
+
+            default:
+                return undefined;
+        }
+
+        block[resultOffset] = result;
+
+        return { block, data: readData };
+    }
+
+    // Number of tracks on one side of a DFS image, according to the sector
+    // count in its catalogue. 80 if the catalogue doesn't say.
+    private getNumDFSTracks(dfsDrive: IDFSDrive): number {
+        // Sector 1 of track 0 of this side. (In a DSD, the sides' tracks are
+        // interleaved, so track 0 of side 1 comes straight after track 0 of
+        // side 0.)
+        const cat1 = dfsDrive.image.read((dfsDrive.side * DFS_TRACK_SIZE_SECTORS + 1) * SECTOR_SIZE_BYTES, SECTOR_SIZE_BYTES);
+        const numSectors = (cat1[6] & 3) << 8 | cat1[7];
+
+        if (numSectors === 0) {
+            return DFS_MAX_NUM_TRACKS;
+        }
+
+        return Math.min(Math.ceil(numSectors / DFS_TRACK_SIZE_SECTORS), DFS_MAX_NUM_TRACKS);
+    }
+
+    private adfsOSWORD(block: Buffer, data: Buffer): IOSWORDResult | undefined {
+        const command = block[5];
+        if (command !== ADFS_READ && command !== ADFS_WRITE) {
+            return undefined;
+        }
+
+        const drive = block[6] >> 5;
+        const image = this.adfsDrives[drive];
+        if (image === undefined) {
+            return undefined;
+        }
+
+        const sector = utils.readUInt24BE(block, 6) & 0x1fffff;
+        const numSectors = block[9];
+        const size = numSectors !== 0 ? numSectors * SECTOR_SIZE_BYTES : block.readUInt32LE(11);
+        const write = command === ADFS_WRITE;
+
+        this.log.pn(`ADFS ${write ? 'write' : 'read'}: drive=${drive} sector=0x${utils.hex(sector, 6)} size=${utils.hexdec(size)}`);
+
+        let result = ADFS_RESULT_OK;
+        let readData: Buffer | undefined;
+
+        if ((sector + Math.ceil(size / SECTOR_SIZE_BYTES)) * SECTOR_SIZE_BYTES > image.data.length) {
+            result = ADFS_RESULT_BAD_ADDRESS;
+        } else if (write && image.writeProtected) {
+            result = ADFS_RESULT_WRITE_PROTECTED;
+        } else {
+            if (write) {
+                mustHaveWriteData(data, size);
+            }
+
+            // Sectors aren't necessarily contiguous in the image (ADFS L
+            // images are interleaved by track), so go a sector at a time.
+            if (!write) {
+                readData = Buffer.alloc(size);
+            }
+
+            for (let i = 0; i * SECTOR_SIZE_BYTES < size; ++i) {
+                const offset = adfsimage.getSectorOffset(image.data, sector + i);
+                const begin = i * SECTOR_SIZE_BYTES;
+                const end = Math.min(begin + SECTOR_SIZE_BYTES, size);
+
+                if (readData !== undefined) {
+                    image.data.copy(readData, begin, offset, offset + (end - begin));
+                } else {
+                    this.writeImage(image, offset, data.slice(begin, end));
+                }
+            }
+        }
+
+        block[0] = result;
+
+        return { block, data: readData };
+    }
+
+    private writeImage(image: Image, offset: number, data: Buffer): void {
+        image.write(offset, data);
+
+        if (this.writeBackTimeout !== undefined) {
+            clearTimeout(this.writeBackTimeout);
+        }
+
+        this.writeBackTimeout = setTimeout(() => {
+            this.writeBackTimeout = undefined;
+            this.flush().catch((error) => {
+                process.stderr.write(`Failed to write back disc image: ${error}\n`);
+            });
+        }, WRITE_BACK_DELAY_MS);
+    }
+
+    private async writeBack(image: Image): Promise<void> {
+        if (!image.dirty) {
+            return;
+        }
+
+        // Clear the flag first - any further writes while this is in progress
+        // will set it again. If the write fails, set it again, so the data
+        // isn't lost.
+        image.dirty = false;
+
+        this.log.pn(`Writing back disc image: ${image.file.hostPath}`);
+        try {
+            await this.bfs.writeDiscImage(image.file, image.data);
+        } catch (error) {
+            image.dirty = true;
+            throw error;
+        }
+    }
+}
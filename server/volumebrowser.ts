@@ -23,6 +23,7 @@
 import * as path from 'path';
 import * as utils from './utils';
 import * as beebfs from './beebfs';
+import * as beeblink from './beeblink';
 
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
@@ -71,14 +72,22 @@ export class Browser {
     private readonly offset: number;
     private normal: string;
     private highlight: string;
+    private normalFG: number;
+    private highlightFG: number;
     private columns: Column[];
     private numFilteredVolumes: number;
-    private volumes: beebfs.Volume[];
+    private volumes: ReadonlyArray<beebfs.Volume>;
+    private volumeNameLCs: ReadonlyArray<string>;
     private x: number;
     private rowIdx: number;
     private colIdx: number;
     private filter: string;
     private filterLCs: string[];
+
+    // filteredIndexes[i] holds the indexes of the volumes that match
+    // filterLCs[0...i]. Each entry is a subset of the previous one, so adding
+    // a filter only has to search the current result set.
+    private filteredIndexes: number[][];
     private log: utils.Log;
     private mode: BrowserMode;
     private boxTL: string;
@@ -100,37 +109,51 @@ export class Browser {
     // used in filter edit mode
     private filterEditY: number;
 
-    public constructor(charSizeBytes: number, width: number, height: number, m128: boolean, volumes: beebfs.Volume[]) {
+    // true if the ROM was last told it could move the cursor itself.
+    private localCursorValid: boolean;
+
+    public constructor(charSizeBytes: number, width: number, height: number, m128: boolean, volumeRegistry: beebfs.VolumeRegistry) {
         this.log = new utils.Log('BROWSER', process.stderr, true);
 
         this.width = width;
         this.height = height;
 
-        this.volumes = volumes;
-        this.volumes.sort((a, b) => utils.stricmp(a.name, b.name));
+        // Already sorted, and won't change under the browser's feet.
+        this.volumes = volumeRegistry.getVolumes();
+        this.volumeNameLCs = volumeRegistry.getNameLCs();
 
+        // The ROM's local cursor code has to draw things the same way. See
+        // the comments for VOLUME_BROWSER_LOCAL_CURSOR_xxx.
         if (charSizeBytes === 32) {
-            this.normal = this.createString(17, 128, 17, 7);
-            this.highlight = this.createString(17, 129, 17, 7);
+            this.normalFG = 7;
+            this.highlightFG = 7;
             this.offset = 0;
             this.teletext = false;
         } else if (charSizeBytes === 16) {
-            this.normal = this.createString(17, 128, 17, 3);
-            this.highlight = this.createString(17, 129, 17, 3);
+            this.normalFG = 3;
+            this.highlightFG = 3;
             this.offset = 0;
             this.teletext = false;
         } else if (charSizeBytes === 8) {
-            this.normal = this.createString(17, 128, 17, 1);
-            this.highlight = this.createString(17, 129, 17, 0);
+            this.normalFG = 1;
+            this.highlightFG = 0;
             this.offset = 0;
             this.teletext = false;
         } else {
+            this.normalFG = 0;
+            this.highlightFG = 0;
+            this.offset = 3;
+            this.teletext = true;
+        }
+
+        if (this.teletext) {
             // The logic for applying these is not the same as in the bitmap
             // modes.
             this.highlight = this.createString(132, 157, 131);
             this.normal = this.createString(32, 135, 156);
-            this.offset = 3;
-            this.teletext = true;
+        } else {
+            this.normal = this.createString(17, 128, 17, this.normalFG);
+            this.highlight = this.createString(17, 129, 17, this.highlightFG);
         }
 
         if (this.teletext || !m128) {
@@ -160,6 +183,7 @@ export class Browser {
         this.mode = BrowserMode.Browse;
         this.filter = '';
         this.filterLCs = [];
+        this.filteredIndexes = [];
 
         this.columns = [];
         this.numFilteredVolumes = 0;
@@ -170,6 +194,8 @@ export class Browser {
         this.boot = false;
 
         this.filterEditY = -1;
+
+        this.localCursorValid = false;
     }
 
     public getInitialString(): Buffer {
@@ -190,6 +216,42 @@ export class Browser {
         return this.createPrintsBuffer();
     }
 
+    // Gets the local cursor info for the ROM, as per
+    // VOLUME_BROWSER_LOCAL_CURSOR_xxx.
+    public getLocalCursor(): Buffer {
+        this.localCursorValid = false;
+
+        if (this.mode === BrowserMode.Browse && this.colIdx >= 0 && this.colIdx < this.columns.length) {
+            const column = this.columns[this.colIdx];
+
+            if (this.rowIdx >= 0 && this.rowIdx < column.rows.length) {
+                const x = column.x - this.x;
+
+                // Highlighted teletext names have 3 extra chars on the end.
+                const x1 = x + column.width + (this.teletext ? 3 : 0);
+
+                if (x >= 0 && x1 < this.width) {
+                    this.localCursorValid = true;
+
+                    const type = this.teletext ? beeblink.VOLUME_BROWSER_LOCAL_CURSOR_TELETEXT : beeblink.VOLUME_BROWSER_LOCAL_CURSOR_BITMAP;
+
+                    return Buffer.from([type, x, this.rowIdx, column.rows.length, this.normalFG, this.highlightFG]);
+                }
+            }
+        }
+
+        return Buffer.from([beeblink.VOLUME_BROWSER_LOCAL_CURSOR_NONE]);
+    }
+
+    // Catch up with any cursor movement the ROM did by itself.
+    public setLocalCursorRow(rowIdx: number): void {
+        if (this.localCursorValid) {
+            if (rowIdx < this.columns[this.colIdx].rows.length) {
+                this.rowIdx = rowIdx;
+            }
+        }
+    }
+
     public handleKey(key: number, shift: boolean): Result {
         this.done = false;
         this.clearPrints();
@@ -246,36 +308,33 @@ export class Browser {
 
         this.numFilteredVolumes = 0;
 
+        let indexes: number[] | undefined;
+        if (this.filteredIndexes.length > 0) {
+            indexes = this.filteredIndexes[this.filteredIndexes.length - 1];
+        }
+
+        const numVolumes = indexes !== undefined ? indexes.length : this.volumes.length;
+
         let newColumn: Column | undefined;
         let x = 0;
         this.columns = [];
-        for (const volume of this.volumes) {
-            const displayNameLC = volume.name.toLowerCase();
-
-            let match = true;
-            for (const filterLC of this.filterLCs) {
-                if (displayNameLC.indexOf(filterLC) < 0) {
-                    match = false;
-                    break;
-                }
-            }
+        for (let i = 0; i < numVolumes; ++i) {
+            const volume = this.volumes[indexes !== undefined ? indexes[i] : i];
 
-            if (match) {
-                if (newColumn === undefined) {
-                    newColumn = new Column();
-                    this.columns.push(newColumn);
-                    newColumn.x = x;
-                }
+            if (newColumn === undefined) {
+                newColumn = new Column();
+                this.columns.push(newColumn);
+                newColumn.x = x;
+            }
 
-                newColumn.width = Math.max(newColumn.width, volume.name.length + this.offset);
+            newColumn.width = Math.max(newColumn.width, volume.name.length + this.offset);
 
-                newColumn.rows.push(volume);
-                ++this.numFilteredVolumes;
+            newColumn.rows.push(volume);
+            ++this.numFilteredVolumes;
 
-                if (newColumn.rows.length === this.height - 1) {
-                    x += newColumn.width + 1;
-                    newColumn = undefined;
-                }
+            if (newColumn.rows.length === this.height - 1) {
+                x += newColumn.width + 1;
+                newColumn = undefined;
             }
         }
 
@@ -324,6 +383,7 @@ export class Browser {
         } else if (key === 27) {
             if (this.filterLCs.length > 0) {
                 this.filterLCs = [];
+                this.filteredIndexes = [];
                 this.updateColumns(this.getSelectedVolume());
                 this.printBrowser();
             } else {
@@ -360,23 +420,49 @@ export class Browser {
             this.printBrowser();
         } else if (key === 13) {
             this.mode = BrowserMode.Browse;
-            this.filterLCs.push(this.filter.toLowerCase());
-            const selectedVolume = this.getSelectedVolume();
-            this.updateColumns(selectedVolume);
-            if (this.numFilteredVolumes === 0) {
-                this.filterLCs.pop();
-                this.updateColumns(selectedVolume);
+            if (!this.pushFilter(this.filter.toLowerCase())) {
                 this.printBrowser();
                 const y = this.printBox('Error', 1);
                 this.printTAB(2, y);
                 this.print('No matches');
                 this.mode = BrowserMode.ShowInfo;
             } else {
+                this.updateColumns(this.getSelectedVolume());
                 this.printBrowser();
             }
         }
     }
 
+    // Narrows the current result set down to the volumes whose names also
+    // contain filterLC. Returns false, leaving things unchanged, if nothing
+    // matches.
+    private pushFilter(filterLC: string): boolean {
+        const indexes: number[] = [];
+
+        if (this.filteredIndexes.length > 0) {
+            for (const index of this.filteredIndexes[this.filteredIndexes.length - 1]) {
+                if (this.volumeNameLCs[index].indexOf(filterLC) >= 0) {
+                    indexes.push(index);
+                }
+            }
+        } else {
+            for (let index = 0; index < this.volumeNameLCs.length; ++index) {
+                if (this.volumeNameLCs[index].indexOf(filterLC) >= 0) {
+                    indexes.push(index);
+                }
+            }
+        }
+
+        if (indexes.length === 0) {
+            return false;
+        }
+
+        this.filterLCs.push(filterLC);
+        this.filteredIndexes.push(indexes);
+
+        return true;
+    }
+
     private handleShowInfoKey(key: number): void {
         this.mode = BrowserMode.Browse;
         this.printBrowser();
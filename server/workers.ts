@@ -0,0 +1,388 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//
+// BeebLink - BBC Micro file storage system
+//
+// Copyright (C) 2019, 2020 Tom Seddon
+// 
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see
+// <https://www.gnu.org/licenses/>.
+//
+//////////////////////////////////////////////////////////////////////////
+
+import * as childProcess from 'child_process';
+import * as beebfs from './beebfs';
+import dfsType from './dfsType';
+import * as gitattributes from './gitattributes';
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Support for --serial-workers, where a supervisor process runs one worker
+// process per serial device, so a crash only takes down one link.
+//
+// The workers share the volume folders. Only the supervisor searches them for
+// volumes; each worker gets the list once the search is done. Files open for
+// write, and files being
+// saved, are locked via the supervisor, and volume creation is broadcast to
+// the other workers so their volume registries stay up to date, as are writes,
+// so nobody hangs on to stale cached info about a file. Workers don't
+// touch .gitattributes or the BASIC cache themselves; they send the updates
+// to the supervisor, which applies them. Messages go over the IPC channel
+// that child_process.fork sets up.
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+interface ILockFileMessage {
+    type: 'lockFile';
+    id: number;
+    hostPath: string;
+    write: boolean;
+}
+
+interface ILockFileResultMessage {
+    type: 'lockFileResult';
+    id: number;
+    ok: boolean;
+}
+
+interface IUnlockFileMessage {
+    type: 'unlockFile';
+    hostPath: string;
+    write: boolean;
+}
+
+interface IVolumeCreatedMessage {
+    type: 'volumeCreated';
+    path: string;
+    name: string;
+}
+
+interface IVolumesMessage {
+    type: 'volumes';
+    volumes: beebfs.IVolumeCheckpoint[];
+}
+
+interface IFileWrittenMessage {
+    type: 'fileWritten';
+    hostPath: string;
+}
+
+interface IMakeVolumeNotTextMessage {
+    type: 'makeVolumeNotText';
+    path: string;
+    name: string;
+}
+
+interface IDeleteFileMessage {
+    type: 'deleteFile';
+    filePath: string;
+}
+
+interface IRenameFileMessage {
+    type: 'renameFile';
+    oldFilePath: string;
+    newFilePath: string;
+}
+
+interface IMakeFileBASICMessage {
+    type: 'makeFileBASIC';
+    filePath: string;
+    basic: boolean;
+}
+
+type GitattributesMessage = IMakeVolumeNotTextMessage | IDeleteFileMessage | IRenameFileMessage | IMakeFileBASICMessage;
+
+type Message = ILockFileMessage | ILockFileResultMessage | IUnlockFileMessage | IVolumeCreatedMessage | IVolumesMessage | IFileWrittenMessage | GitattributesMessage;
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+class FileLock {
+    public numReaders = 0;
+    public numWriters = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Worker end.
+export class WorkerSharing implements beebfs.IFSSharing {
+    private nextId: number;
+    private resolveById: Map<number, (ok: boolean) => void>;
+
+    public constructor(volumeRegistry: beebfs.VolumeRegistry) {
+        this.nextId = 1;
+        this.resolveById = new Map<number, (ok: boolean) => void>();
+
+        process.on('message', (message: Message): void => {
+            if (message.type === 'lockFileResult') {
+                const resolve = this.resolveById.get(message.id);
+                if (resolve !== undefined) {
+                    this.resolveById.delete(message.id);
+                    resolve(message.ok);
+                }
+            } else if (message.type === 'volumeCreated') {
+                volumeRegistry.add(new beebfs.Volume(message.path, message.name, dfsType));
+            } else if (message.type === 'volumes') {
+                for (const json of message.volumes) {
+                    const volume = beebfs.tryCreateVolumeFromJSON(json);
+                    if (volume !== undefined) {
+                        volumeRegistry.add(volume);
+                    }
+                }
+
+                volumeRegistry.setComplete();
+            } else if (message.type === 'fileWritten') {
+                beebfs.fileWrittenElsewhere(message.hostPath);
+            }
+        });
+
+        // If the supervisor goes away, so should the worker.
+        process.on('disconnect', (): void => {
+            process.exit(1);
+        });
+    }
+
+    public async lockFile(hostPath: string, write: boolean): Promise<boolean> {
+        const id = this.nextId++;
+
+        return await new Promise<boolean>((resolve) => {
+            this.resolveById.set(id, resolve);
+            this.send({ type: 'lockFile', id, hostPath, write });
+        });
+    }
+
+    public unlockFile(hostPath: string, write: boolean): void {
+        this.send({ type: 'unlockFile', hostPath, write });
+    }
+
+    public volumeCreated(volume: beebfs.Volume): void {
+        this.send({ type: 'volumeCreated', path: volume.path, name: volume.name });
+    }
+
+    public fileWritten(hostPath: string): void {
+        this.send({ type: 'fileWritten', hostPath });
+    }
+
+    // Get IManipulator that forwards .gitattributes updates to the
+    // supervisor.
+    public getGitattributes(): gitattributes.IManipulator {
+        return {
+            makeVolumeNotText: (volume: beebfs.Volume): void => {
+                if (!volume.isReadOnly()) {
+                    this.send({ type: 'makeVolumeNotText', path: volume.path, name: volume.name });
+                }
+            },
+            deleteFile: (filePath: string): void => this.send({ type: 'deleteFile', filePath }),
+            renameFile: (oldFilePath: string, newFilePath: string): void => this.send({ type: 'renameFile', oldFilePath, newFilePath }),
+            makeFileBASIC: (filePath: string, basic: boolean): void => this.send({ type: 'makeFileBASIC', filePath, basic }),
+        };
+    }
+
+    private send(message: Message): void {
+        if (process.send !== undefined) {
+            process.send(message);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Who holds a lock: a worker process, or the supervisor itself (for HTTP
+// connections, which it serves directly).
+type LockOwner = childProcess.ChildProcess | 'supervisor';
+
+// Supervisor end.
+export class Supervisor {
+    private modulePath: string;
+    private args: string[];
+    private restartDelayMS: number;
+    private volumeRegistry: beebfs.VolumeRegistry;
+    private gaManipulator: gitattributes.Manipulator | undefined;
+    private workerByPortPath: Map<string, childProcess.ChildProcess>;
+    private lockByHostPath: Map<string, FileLock>;
+
+    // Locks held by each owner, so they can be released if a worker dies.
+    private locksByOwner: Map<LockOwner, IUnlockFileMessage[]>;
+
+    public constructor(modulePath: string, args: string[], restartDelayMS: number, volumeRegistry: beebfs.VolumeRegistry, gaManipulator: gitattributes.Manipulator | undefined) {
+        this.modulePath = modulePath;
+        this.args = args;
+        this.restartDelayMS = restartDelayMS;
+        this.volumeRegistry = volumeRegistry;
+        this.gaManipulator = gaManipulator;
+        this.workerByPortPath = new Map<string, childProcess.ChildProcess>();
+        this.lockByHostPath = new Map<string, FileLock>();
+        this.locksByOwner = new Map<LockOwner, IUnlockFileMessage[]>();
+        this.locksByOwner.set('supervisor', []);
+    }
+
+    // Start a worker for the given serial port, if there isn't one already.
+    public ensureWorker(portPath: string): void {
+        if (this.workerByPortPath.has(portPath)) {
+            return;
+        }
+
+        process.stderr.write(`${portPath}: starting worker process.\n`);
+
+        const worker = childProcess.fork(this.modulePath, this.args.concat(['--serial-worker', portPath]));
+
+        this.workerByPortPath.set(portPath, worker);
+        this.locksByOwner.set(worker, []);
+
+        worker.on('message', (message: Message): void => {
+            this.handleMessage(worker, message);
+        });
+
+        // If the volume search isn't finished yet, the worker gets the list
+        // when it is.
+        if (this.volumeRegistry.isComplete()) {
+            worker.send(this.getVolumesMessage());
+        }
+
+        worker.on('exit', (code: number | null, signal: string | null): void => {
+            process.stderr.write(`${portPath}: worker process exited (code=${code}, signal=${signal}).\n`);
+
+            const locks = this.locksByOwner.get(worker);
+            if (locks !== undefined) {
+                for (const lock of locks) {
+                    this.unlockFile(lock.hostPath, lock.write);
+                }
+            }
+            this.locksByOwner.delete(worker);
+
+            // Leave the port unclaimed for a bit, so it gets restarted on the
+            // next check after that if the device is still there.
+            setTimeout(() => {
+                this.workerByPortPath.delete(portPath);
+            }, this.restartDelayMS);
+        });
+    }
+
+    // Call once the supervisor's volume registry is complete, to pass the
+    // volume list on to the workers.
+    public sendVolumes(): void {
+        this.broadcast('supervisor', this.getVolumesMessage());
+    }
+
+    // Get IFSSharing for FSs in the supervisor process.
+    public getSharing(): beebfs.IFSSharing {
+        return {
+            lockFile: async (hostPath: string, write: boolean): Promise<boolean> => this.lockFile('supervisor', hostPath, write),
+            unlockFile: (hostPath: string, write: boolean): void => this.releaseLock('supervisor', hostPath, write),
+            volumeCreated: (volume: beebfs.Volume): void => this.broadcast('supervisor', { type: 'volumeCreated', path: volume.path, name: volume.name }),
+            fileWritten: (hostPath: string): void => this.broadcast('supervisor', { type: 'fileWritten', hostPath }),
+        };
+    }
+
+    private handleMessage(worker: childProcess.ChildProcess, message: Message): void {
+        if (message.type === 'lockFile') {
+            const ok = this.lockFile(worker, message.hostPath, message.write);
+            worker.send({ type: 'lockFileResult', id: message.id, ok });
+        } else if (message.type === 'unlockFile') {
+            this.releaseLock(worker, message.hostPath, message.write);
+        } else if (message.type === 'volumeCreated') {
+            this.volumeRegistry.add(new beebfs.Volume(message.path, message.name, dfsType));
+            this.broadcast(worker, message);
+        } else if (message.type === 'fileWritten') {
+            beebfs.fileWrittenElsewhere(message.hostPath);
+            this.broadcast(worker, message);
+        } else if (this.gaManipulator !== undefined) {
+            if (message.type === 'makeVolumeNotText') {
+                this.gaManipulator.makeVolumeNotText(new beebfs.Volume(message.path, message.name, dfsType));
+            } else if (message.type === 'deleteFile') {
+                this.gaManipulator.deleteFile(message.filePath);
+            } else if (message.type === 'renameFile') {
+                this.gaManipulator.renameFile(message.oldFilePath, message.newFilePath);
+            } else if (message.type === 'makeFileBASIC') {
+                this.gaManipulator.makeFileBASIC(message.filePath, message.basic);
+            }
+        }
+    }
+
+    private getVolumesMessage(): IVolumesMessage {
+        return { type: 'volumes', volumes: this.volumeRegistry.getVolumes().map(beebfs.getVolumeJSON) };
+    }
+
+    private broadcast(from: LockOwner, message: Message): void {
+        for (const worker of this.workerByPortPath.values()) {
+            if (worker !== from && worker.connected) {
+                worker.send(message);
+            }
+        }
+    }
+
+    private lockFile(owner: LockOwner, hostPath: string, write: boolean): boolean {
+        let lock = this.lockByHostPath.get(hostPath);
+        if (lock === undefined) {
+            lock = new FileLock();
+            this.lockByHostPath.set(hostPath, lock);
+        }
+
+        // Same rules as FS.OSFINDOpen: once for write, or multiple times for
+        // read.
+        let ok: boolean;
+        if (write) {
+            ok = lock.numReaders === 0 && lock.numWriters === 0;
+        } else {
+            ok = lock.numWriters === 0;
+        }
+
+        if (ok) {
+            if (write) {
+                ++lock.numWriters;
+            } else {
+                ++lock.numReaders;
+            }
+
+            const locks = this.locksByOwner.get(owner);
+            if (locks !== undefined) {
+                locks.push({ type: 'unlockFile', hostPath, write });
+            }
+        }
+
+        return ok;
+    }
+
+    private releaseLock(owner: LockOwner, hostPath: string, write: boolean): void {
+        const locks = this.locksByOwner.get(owner);
+        if (locks !== undefined) {
+            const index = locks.findIndex((lock) => lock.hostPath === hostPath && lock.write === write);
+            if (index >= 0) {
+                locks.splice(index, 1);
+                this.unlockFile(hostPath, write);
+            }
+        }
+    }
+
+    private unlockFile(hostPath: string, write: boolean): void {
+        const lock = this.lockByHostPath.get(hostPath);
+        if (lock === undefined) {
+            return;
+        }
+
+        if (write) {
+            --lock.numWriters;
+        } else {
+            --lock.numReaders;
+        }
+
+        if (lock.numReaders === 0 && lock.numWriters === 0) {
+            this.lockByHostPath.delete(hostPath);
+        }
+    }
+}